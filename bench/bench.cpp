@@ -0,0 +1,129 @@
+// Conversion and write benchmarks. writer.cpp is compiled into this file so
+// that kdb_to_arrow and ConvertContext, which are internal to it, can be
+// measured directly.
+#include "../writer.cpp"
+#include "k_shim.h"
+#include <arrow/util/config.h>
+#include <benchmark/benchmark.h>
+#if __has_include(<arrow/compute/initialize.h>)
+#include <arrow/compute/initialize.h>
+#endif
+namespace {
+const vector<pair<string, signed char>> column_types = {
+    {"boolean", KB},  {"short", KH}, {"int", KI},       {"long", KJ},
+    {"real", KE},     {"float", KF}, {"date", KD},      {"timestamp", KP},
+    {"timespan", KN}, {"time", KT},  {"symbol", KS},    {"enum", 20},
+    {"string", 0}};
+// Columns are converted in parallel, so BM_Convert tables are this wide
+const int convert_columns = 16;
+const vector<string> codecs = {"uncompressed", "snappy", "zstd", "gzip"};
+string bench_dir() {
+  const char* dir = getenv("BENCH_DIR");
+  return dir ? dir : filesystem::temp_directory_path().string();
+}
+int64_t disk_bytes(const filesystem::path& path) {
+  if (!filesystem::is_directory(path)) return filesystem::file_size(path);
+  int64_t bytes = 0;
+  for (auto& e : filesystem::recursive_directory_iterator(path)) {
+    if (e.is_regular_file()) bytes += e.file_size();
+  }
+  return bytes;
+}
+// Args: column type index, null percentage, rows, conversion_threads
+void BM_Convert(benchmark::State& state) {
+  auto [name, t] = column_types[state.range(0)];
+  double null_rate = state.range(1) / 100.0;
+  J n = state.range(2);
+  vector<pair<string, signed char>> cols;
+  for (int c = 0; c < convert_columns; ++c) {
+    cols.emplace_back(name + to_string(c), t);
+  }
+  K table = make_table(cols, n, null_rate);
+  ConvertContext ctx;
+  ctx.syms = bench_syms();
+  ConvertOptions conv_opts;
+  conv_opts.conversion_threads = state.range(3);
+  Status st = prepare_convert(table, conv_opts, ctx);
+  for (auto _ : state) {
+    shared_ptr<Table> arrow_table;
+    if (st.ok()) st = kdb_to_arrow(arrow_table, table, ctx);
+    if (!st.ok()) {
+      state.SkipWithError(st.ToString().c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(arrow_table);
+  }
+  state.SetItemsProcessed(state.iterations() * n * convert_columns);
+  state.SetBytesProcessed(state.iterations() * n * convert_columns *
+                          row_bytes(t));
+  state.SetLabel(name + " threads:" + to_string(state.range(3)));
+  r0(table);
+}
+// Args: codec index, partitioned by sym, rows
+void BM_WriteParquet(benchmark::State& state) {
+  const string& codec = codecs[state.range(0)];
+  bool partitioned = state.range(1);
+  J n = state.range(2);
+  K table = make_trades(n, 100);
+  K keys = ktn(KS, 0);
+  js(&keys, ss((S) "compression"));
+  K opts = xD(keys, knk(1, ks((S)codec.c_str())));
+  filesystem::path path =
+      filesystem::path(bench_dir()) /
+      ("kdb_parquet_bench_" + codec + (partitioned ? "" : ".parquet"));
+  K par_cols = partitioned ? ks((S) "sym") : ktn(0, 0);
+  K k_path = ks((S)path.string().c_str());
+  for (auto _ : state) {
+    filesystem::remove_all(path);
+    K result = write_parquet(table, k_path, par_cols, opts);
+    if (result || !filesystem::exists(path)) {
+      state.SkipWithError("write_parquet failed");
+      break;
+    }
+  }
+  J in_bytes = 0;
+  K cols = kK(table->k)[1];
+  for (J c = 0; c < cols->n; ++c) in_bytes += n * row_bytes(kK(cols)[c]->t);
+  state.SetItemsProcessed(state.iterations() * n);
+  state.SetBytesProcessed(state.iterations() * in_bytes);
+  if (filesystem::exists(path)) {
+    int64_t out_bytes = disk_bytes(path);
+    state.counters["file_bytes"] = out_bytes;
+    state.counters["ratio"] = double(in_bytes) / out_bytes;
+  }
+  state.SetLabel(codec + (partitioned ? " partitioned" : " flat"));
+  filesystem::remove_all(path);
+  r0(k_path);
+  r0(par_cols);
+  r0(opts);
+  r0(table);
+}
+} // namespace
+BENCHMARK(BM_Convert)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, column_types.size() - 1, 1),
+                   {0, 10, 50},
+                   {1 << 16, 1 << 20},
+                   {1}})
+    ->Unit(benchmark::kMicrosecond);
+// Core scaling: 1..16 conversion threads over the same table
+BENCHMARK(BM_Convert)
+    ->ArgsProduct({{3, 5, 10, 12}, {10}, {1 << 20}, {1, 2, 4, 8, 16}})
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+BENCHMARK(BM_WriteParquet)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, codecs.size() - 1, 1),
+                   {0, 1},
+                   {1 << 18, 1 << 21}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+int main(int argc, char** argv) {
+#if ARROW_VERSION_MAJOR >= 21
+  // Dataset writes need the compute functions registered
+  ARROW_CHECK_OK(arrow::compute::Initialize());
+#endif
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,106 @@
+#include "k_shim.h"
+#include <cmath>
+#include <random>
+#include <string>
+// Only q provides these. Benchmarks never build anymaps or use callbacks.
+extern "C" K vi(K x, UJ i) { return krr((S) "vi"); }
+extern "C" K sd1(I d, K (*f)(I)) { return (K)0; }
+extern "C" V sd0(I d) {}
+extern "C" K dot(K x, K y) { return krr((S) "dot"); }
+K bench_syms() {
+  static K syms = [] {
+    K s = ktn(KS, 0);
+    js(&s, ss((S) ""));
+    for (int i = 1; i < 1000; ++i) {
+      js(&s, ss((S)("SYM" + std::to_string(i)).c_str()));
+    }
+    return s;
+  }();
+  return syms;
+}
+K make_column(signed char t, J n, double null_rate) {
+  std::mt19937_64 rng(t * 7919 + n);
+  std::bernoulli_distribution null(null_rate);
+  std::uniform_int_distribution<J> value(0, 1 << 20);
+  K syms = bench_syms();
+  K x = ktn(t >= 20 ? KJ : t, t ? n : 0);
+  if (t >= 20) x->t = t;
+  for (J i = 0; i < n; ++i) {
+    bool is_null = null(rng);
+    J v = value(rng);
+    switch (t) {
+      case 0: {
+        std::string s = "str" + std::to_string(v);
+        jk(&x, is_null ? ktn(KC, 0) : kpn((S)s.c_str(), s.size()));
+        break;
+      }
+      case KB:
+        kG(x)[i] = v & 1;
+        break;
+      case KH:
+        kH(x)[i] = is_null ? nh : H(v);
+        break;
+      case KI:
+      case KD:
+      case KT:
+        kI(x)[i] = is_null ? ni : I(v);
+        break;
+      case KJ:
+      case KP:
+      case KN:
+        kJ(x)[i] = is_null ? nj : v * 1000;
+        break;
+      case KE:
+        kE(x)[i] = is_null ? E(nf) : E(v) / 8;
+        break;
+      case KF:
+        kF(x)[i] = is_null ? nf : F(v) / 8;
+        break;
+      case KS:
+        kS(x)[i] = kS(syms)[is_null ? 0 : 1 + v % (syms->n - 1)];
+        break;
+      default: // enumeration over bench_syms
+        kJ(x)[i] = is_null ? 0 : 1 + v % (syms->n - 1);
+    }
+  }
+  return x;
+}
+K make_table(const std::vector<std::pair<std::string, signed char>>& cols,
+             J n, double null_rate) {
+  K names = ktn(KS, 0);
+  K values = ktn(0, 0);
+  for (auto& [name, t] : cols) {
+    js(&names, ss((S)name.c_str()));
+    jk(&values, make_column(t, n, null_rate));
+  }
+  return xT(xD(names, values));
+}
+K make_trades(J n, J n_syms) {
+  K syms = bench_syms();
+  K t = make_table(
+      {{"sym", KS}, {"time", KP}, {"price", KF}, {"size", KJ}, {"ex", KS}}, n,
+      0);
+  K cols = kK(t->k)[1];
+  for (J i = 0; i < n; ++i) {
+    kS(kK(cols)[0])[i] = kS(syms)[1 + i * n_syms / n];
+    kJ(kK(cols)[1])[i] = 800000000000000000LL + i * 1000;
+  }
+  return t;
+}
+J row_bytes(signed char t) {
+  switch (t) {
+    case 0:
+      return 16; // K header plus a short string
+    case KB:
+      return 1;
+    case KH:
+      return 2;
+    case KI:
+    case KD:
+    case KT:
+    case KE:
+      return 4;
+    default:
+      return 8;
+  }
+}
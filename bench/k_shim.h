@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <utility>
+#include <vector>
+extern "C" {
+#include "k.h"
+}
+// Synthetic kdb+ data for the benchmarks. K objects are built in-process with
+// the construction functions from c.o (ktn, knk, xT, ...); k_shim.cpp also
+// stands in for the few entry points only a q process provides.
+
+// Symbol list used as the domain of enumerated columns (type 20)
+K bench_syms();
+// Column of n values of kdb+ type t (0 for a list of strings), with about
+// null_rate of them null
+K make_column(signed char t, J n, double null_rate);
+// Table with one column per (name, type)
+K make_table(const std::vector<std::pair<std::string, signed char>>& cols,
+             J n, double null_rate);
+// Trade-like table sorted by sym: sym, time, price, size, ex
+K make_trades(J n, J n_syms);
+// Bytes per row of a column of type t as held in kdb+, strings included
+J row_bytes(signed char t);
@@ -0,0 +1,287 @@
+#include "kernels.h"
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KERNELS_X86
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+using namespace std;
+namespace {
+enum class Isa { scalar, avx2, avx512 };
+Isa detect_isa() {
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return Isa::avx512;
+  if (__builtin_cpu_supports("avx2")) return Isa::avx2;
+#endif
+  return Isa::scalar;
+}
+const Isa isa = detect_isa();
+// What a kernel writes to `out` besides the validity bitmap
+enum class Op { none, add, mul };
+// Scalar loop, used as fallback and for the tail after the last full block
+template <Op op, typename T, typename IsNull>
+int64_t scalar(const T* v, int64_t i, int64_t n, T offset, T* out,
+               uint8_t* bits, IsNull is_null) {
+  int64_t nulls = 0;
+  for (; i < n; ++i) {
+    if (is_null(v[i])) {
+      ++nulls;
+    } else {
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    }
+    if (op == Op::add) out[i] = v[i] + offset;
+    if (op == Op::mul) out[i] = T(uint64_t(v[i]) * uint64_t(offset)); // wraps
+  }
+  return nulls;
+}
+template <typename M> inline void store_bits(uint8_t* bits, M valid) {
+  memcpy(bits, &valid, sizeof(M));
+}
+#ifdef KERNELS_X86
+// AVX2 kernels. Each processes whole bitmap bytes and leaves the index of the
+// first unprocessed element in `i`.
+TARGET_AVX2 int64_t h_avx2(const H* v, int64_t n, uint8_t* bits, int64_t& i) {
+  const __m256i null = _mm256_set1_epi16(H(nh));
+  int64_t nulls = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(v + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(v + i + 16));
+    __m256i packed = _mm256_packs_epi16(_mm256_cmpeq_epi16(a, null),
+                                        _mm256_cmpeq_epi16(b, null));
+    uint32_t m = _mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, 0xD8));
+    store_bits(bits + (i >> 3), ~m);
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+template <Op op>
+TARGET_AVX2 int64_t i_avx2(const I* v, int64_t n, I offset, I* out,
+                           uint8_t* bits, int64_t& i) {
+  const __m256i null = _mm256_set1_epi32(ni);
+  const __m256i off = _mm256_set1_epi32(offset);
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(v + i));
+    uint8_t m = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, null)));
+    if (op == Op::add)
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi32(a, off));
+    if (op == Op::mul)
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_mullo_epi32(a, off));
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+template <Op op>
+TARGET_AVX2 int64_t j_avx2(const J* v, int64_t n, J offset, J* out,
+                           uint8_t* bits, int64_t& i) {
+  const __m256i null = _mm256_set1_epi64x(nj);
+  const __m256i off = _mm256_set1_epi64x(offset);
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(v + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(v + i + 4));
+    uint8_t m =
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, null))) |
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, null)))
+            << 4;
+    if (op == Op::add) {
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi64(a, off));
+      _mm256_storeu_si256((__m256i*)(out + i + 4), _mm256_add_epi64(b, off));
+    }
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+TARGET_AVX2 int64_t e_avx2(const E* v, int64_t n, uint8_t* bits, int64_t& i) {
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(v + i);
+    uint8_t m = _mm256_movemask_ps(_mm256_cmp_ps(a, a, _CMP_UNORD_Q));
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+TARGET_AVX2 int64_t f_avx2(const F* v, int64_t n, uint8_t* bits, int64_t& i) {
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256d a = _mm256_loadu_pd(v + i);
+    __m256d b = _mm256_loadu_pd(v + i + 4);
+    uint8_t m = _mm256_movemask_pd(_mm256_cmp_pd(a, a, _CMP_UNORD_Q)) |
+                _mm256_movemask_pd(_mm256_cmp_pd(b, b, _CMP_UNORD_Q)) << 4;
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+// AVX-512 kernels, comparing straight into mask registers
+TARGET_AVX512 int64_t h_avx512(const H* v, int64_t n, uint8_t* bits,
+                               int64_t& i) {
+  const __m512i null = _mm512_set1_epi16(H(nh));
+  int64_t nulls = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint32_t m =
+        _mm512_cmpeq_epi16_mask(_mm512_loadu_si512((const void*)(v + i)), null);
+    store_bits(bits + (i >> 3), ~m);
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+template <Op op>
+TARGET_AVX512 int64_t i_avx512(const I* v, int64_t n, I offset, I* out,
+                               uint8_t* bits, int64_t& i) {
+  const __m512i null = _mm512_set1_epi32(ni);
+  const __m512i off = _mm512_set1_epi32(offset);
+  int64_t nulls = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i a = _mm512_loadu_si512((const void*)(v + i));
+    uint16_t m = _mm512_cmpeq_epi32_mask(a, null);
+    if (op == Op::add)
+      _mm512_storeu_si512((void*)(out + i), _mm512_add_epi32(a, off));
+    if (op == Op::mul)
+      _mm512_storeu_si512((void*)(out + i), _mm512_mullo_epi32(a, off));
+    store_bits(bits + (i >> 3), uint16_t(~m));
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+template <Op op>
+TARGET_AVX512 int64_t j_avx512(const J* v, int64_t n, J offset, J* out,
+                               uint8_t* bits, int64_t& i) {
+  const __m512i null = _mm512_set1_epi64(nj);
+  const __m512i off = _mm512_set1_epi64(offset);
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void*)(v + i));
+    uint8_t m = _mm512_cmpeq_epi64_mask(a, null);
+    if (op == Op::add)
+      _mm512_storeu_si512((void*)(out + i), _mm512_add_epi64(a, off));
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+TARGET_AVX512 int64_t e_avx512(const E* v, int64_t n, uint8_t* bits,
+                               int64_t& i) {
+  int64_t nulls = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 a = _mm512_loadu_ps(v + i);
+    uint16_t m = _mm512_cmp_ps_mask(a, a, _CMP_UNORD_Q);
+    store_bits(bits + (i >> 3), uint16_t(~m));
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+TARGET_AVX512 int64_t f_avx512(const F* v, int64_t n, uint8_t* bits,
+                               int64_t& i) {
+  int64_t nulls = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d a = _mm512_loadu_pd(v + i);
+    uint8_t m = _mm512_cmp_pd_mask(a, a, _CMP_UNORD_Q);
+    bits[i >> 3] = ~m;
+    nulls += __builtin_popcount(m);
+  }
+  return nulls;
+}
+#endif
+} // namespace
+int64_t validity_h(const H* values, int64_t n, uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = h_avx512(values, n, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = h_avx2(values, n, bits, i);
+#endif
+  return nulls + scalar<Op::none>(values, i, n, H(0), (H*)nullptr, bits,
+                               [](H v) { return v == nh; });
+}
+int64_t validity_i(const I* values, int64_t n, uint8_t* bits) {
+  return validity_shift_i(values, n, 0, nullptr, bits);
+}
+int64_t validity_j(const J* values, int64_t n, uint8_t* bits) {
+  return validity_shift_j(values, n, 0, nullptr, bits);
+}
+int64_t validity_e(const E* values, int64_t n, uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = e_avx512(values, n, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = e_avx2(values, n, bits, i);
+#endif
+  return nulls + scalar<Op::none>(values, i, n, E(0), (E*)nullptr, bits,
+                               [](E v) { return isnan(v); });
+}
+int64_t validity_f(const F* values, int64_t n, uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = f_avx512(values, n, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = f_avx2(values, n, bits, i);
+#endif
+  return nulls + scalar<Op::none>(values, i, n, F(0), (F*)nullptr, bits,
+                               [](F v) { return isnan(v); });
+}
+int64_t validity_shift_i(const I* values, int64_t n, I offset, I* out,
+                         uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+  auto is_null = [](I v) { return v == ni; };
+  if (out) {
+#ifdef KERNELS_X86
+    if (isa == Isa::avx512)
+      nulls = i_avx512<Op::add>(values, n, offset, out, bits, i);
+    else if (isa == Isa::avx2)
+      nulls = i_avx2<Op::add>(values, n, offset, out, bits, i);
+#endif
+    return nulls + scalar<Op::add>(values, i, n, offset, out, bits, is_null);
+  }
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = i_avx512<Op::none>(values, n, offset, out, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = i_avx2<Op::none>(values, n, offset, out, bits, i);
+#endif
+  return nulls + scalar<Op::none>(values, i, n, offset, out, bits, is_null);
+}
+int64_t validity_shift_j(const J* values, int64_t n, J offset, J* out,
+                         uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+  auto is_null = [](J v) { return v == nj; };
+  if (out) {
+#ifdef KERNELS_X86
+    if (isa == Isa::avx512)
+      nulls = j_avx512<Op::add>(values, n, offset, out, bits, i);
+    else if (isa == Isa::avx2)
+      nulls = j_avx2<Op::add>(values, n, offset, out, bits, i);
+#endif
+    return nulls + scalar<Op::add>(values, i, n, offset, out, bits, is_null);
+  }
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = j_avx512<Op::none>(values, n, offset, out, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = j_avx2<Op::none>(values, n, offset, out, bits, i);
+#endif
+  return nulls + scalar<Op::none>(values, i, n, offset, out, bits, is_null);
+}
+int64_t validity_scale_i(const I* values, int64_t n, I factor, I* out,
+                         uint8_t* bits) {
+  int64_t i = 0, nulls = 0;
+#ifdef KERNELS_X86
+  if (isa == Isa::avx512)
+    nulls = i_avx512<Op::mul>(values, n, factor, out, bits, i);
+  else if (isa == Isa::avx2)
+    nulls = i_avx2<Op::mul>(values, n, factor, out, bits, i);
+#endif
+  return nulls + scalar<Op::mul>(values, i, n, factor, out, bits,
+                                 [](I v) { return v == ni; });
+}
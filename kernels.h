@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+extern "C" {
+#include "k.h"
+}
+// Vectorized null-sentinel scans over kdb vectors (AVX-512, AVX2 or scalar,
+// picked at runtime). Each kernel packs the Arrow validity bitmap of `n`
+// values into `bits`, which must hold (n + 7) / 8 zeroed bytes, and returns
+// the null count. The shift kernels also write value + offset to `out`, and
+// the scale kernel value * factor.
+int64_t validity_h(const H* values, int64_t n, uint8_t* bits);
+int64_t validity_i(const I* values, int64_t n, uint8_t* bits);
+int64_t validity_j(const J* values, int64_t n, uint8_t* bits);
+int64_t validity_e(const E* values, int64_t n, uint8_t* bits);
+int64_t validity_f(const F* values, int64_t n, uint8_t* bits);
+int64_t validity_shift_i(const I* values, int64_t n, I offset, I* out,
+                         uint8_t* bits);
+int64_t validity_shift_j(const J* values, int64_t n, J offset, J* out,
+                         uint8_t* bits);
+int64_t validity_scale_i(const I* values, int64_t n, I factor, I* out,
+                         uint8_t* bits);
@@ -0,0 +1,842 @@
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/util/parallel.h>
+#include <arrow/util/thread_pool.h>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <parquet/api/reader.h>
+#include <string_view>
+#include <unordered_map>
+extern "C" {
+#include "k.h"
+}
+using namespace arrow;
+using namespace std;
+#define CHECK_STATUS(expr)                                                     \
+  {                                                                            \
+    status = expr;                                                             \
+    if (!status.ok()) {                                                        \
+      k_err = status.message();                                                \
+      return krr((S)k_err.c_str());                                            \
+    }                                                                          \
+  }
+namespace {
+const string hive_null = "__HIVE_DEFAULT_PARTITION__";
+// A column, filter or statistics value in q representation. Nulls compare
+// below everything, as in q.
+struct Value {
+  enum Kind { integer, real, symbol } kind = integer;
+  J j = 0;
+  F f = 0;
+  string_view s;
+};
+Value::Kind kind_of(signed char t) {
+  return t == KS ? Value::symbol
+                 : (t == KE || t == KF ? Value::real : Value::integer);
+}
+bool value_at(K x, J i, Value& v) {
+  signed char t = x->t < 0 ? -x->t : x->t;
+  bool atom = x->t < 0;
+  v.kind = kind_of(t);
+  switch (t) {
+    case KB:
+    case KG:
+      v.j = atom ? x->g : kG(x)[i];
+      return true;
+    case KH:
+      v.j = atom ? x->h : kH(x)[i];
+      return true;
+    case KI:
+    case KM:
+    case KD:
+    case KU:
+    case KV:
+    case KT:
+      v.j = atom ? x->i : kI(x)[i];
+      return true;
+    case KJ:
+    case KP:
+    case KN:
+      v.j = atom ? x->j : kJ(x)[i];
+      return true;
+    case KE:
+      v.f = atom ? x->e : kE(x)[i];
+      break;
+    case KF:
+      v.f = atom ? x->f : kF(x)[i];
+      break;
+    case KS:
+      v.s = atom ? x->s : kS(x)[i];
+      return true;
+    default:
+      return false;
+  }
+  if (isnan(v.f)) v.f = -INFINITY;
+  return true;
+}
+int compare(const Value& a, const Value& b) {
+  if (a.kind == Value::symbol) return a.s.compare(b.s);
+  if (a.kind == Value::integer && b.kind == Value::integer)
+    return (a.j > b.j) - (a.j < b.j);
+  F x = a.kind == Value::real ? a.f : F(a.j);
+  F y = b.kind == Value::real ? b.f : F(b.j);
+  return (x > y) - (x < y);
+}
+struct Condition {
+  enum Op { eq, lt, le, gt, ge, within, in } op;
+  string col;
+  vector<Value> values; // bound, within's low and high, or in's list
+  vector<signed char> types; // q type of each value
+};
+bool matches(const Condition& c, const Value& v) {
+  switch (c.op) {
+    case Condition::eq:
+      return compare(v, c.values[0]) == 0;
+    case Condition::lt:
+      return compare(v, c.values[0]) < 0;
+    case Condition::le:
+      return compare(v, c.values[0]) <= 0;
+    case Condition::gt:
+      return compare(v, c.values[0]) > 0;
+    case Condition::ge:
+      return compare(v, c.values[0]) >= 0;
+    case Condition::within:
+      return compare(v, c.values[0]) >= 0 && compare(v, c.values[1]) <= 0;
+    case Condition::in:
+      for (auto& x : c.values)
+        if (compare(v, x) == 0) return true;
+  }
+  return false;
+}
+// Whether any value in [min, max] can satisfy the condition
+bool may_match(const Condition& c, const Value& min, const Value& max) {
+  switch (c.op) {
+    case Condition::eq:
+      return compare(min, c.values[0]) <= 0 && compare(max, c.values[0]) >= 0;
+    case Condition::lt:
+      return compare(min, c.values[0]) < 0;
+    case Condition::le:
+      return compare(min, c.values[0]) <= 0;
+    case Condition::gt:
+      return compare(max, c.values[0]) > 0;
+    case Condition::ge:
+      return compare(max, c.values[0]) >= 0;
+    case Condition::within:
+      return compare(max, c.values[0]) >= 0 && compare(min, c.values[1]) <= 0;
+    case Condition::in:
+      for (auto& x : c.values)
+        if (compare(min, x) <= 0 && compare(max, x) >= 0) return true;
+  }
+  return false;
+}
+Status parse_condition(K cond, Condition& c) {
+  static const unordered_map<string, Condition::Op> ops = {
+      {"=", Condition::eq},      {"<", Condition::lt},
+      {"<=", Condition::le},     {">", Condition::gt},
+      {">=", Condition::ge},     {"within", Condition::within},
+      {"in", Condition::in}};
+  if (cond->t != 0 || cond->n != 3 || kK(cond)[0]->t != -KS ||
+      kK(cond)[1]->t != -KS) {
+    return Status::Invalid("filter must be (op;column;value) triples");
+  }
+  auto op = ops.find(kK(cond)[0]->s);
+  if (op == ops.end()) {
+    return Status::Invalid(string("unsupported filter op ") + kK(cond)[0]->s);
+  }
+  c.op = op->second;
+  c.col = kK(cond)[1]->s;
+  K vals = kK(cond)[2];
+  J n = vals->t < 0 ? 1 : vals->n;
+  c.values.resize(n);
+  c.types.resize(n);
+  for (J i = 0; i < n; ++i) {
+    K x = vals->t == 0 ? kK(vals)[i] : vals;
+    if ((vals->t == 0 && x->t >= 0) || !value_at(x, i, c.values[i])) {
+      return Status::Invalid("unsupported filter value for " + c.col);
+    }
+    c.types[i] = x->t < 0 ? -x->t : x->t;
+  }
+  if (c.op == Condition::within ? n != 2 : (c.op != Condition::in && n != 1)) {
+    return Status::Invalid("wrong number of filter values for " + c.col);
+  }
+  return Status::OK();
+}
+// A result column: either a leaf column of the Parquet files or a Hive
+// partition key
+struct ReadColumn {
+  string name;
+  signed char type = 0;
+  J mul = 1, offset = 0; // q value = Parquet value * mul - offset
+  int key = -1;          // partition key index, -1 for file columns
+  bool projected = false, filtered = false;
+  K values = nullptr;
+  // why the column cannot be read (guid, nested), empty if it can; only an
+  // error once the column is projected or filtered on
+  string unsupported;
+};
+struct ReadFile {
+  string path;
+  vector<string> keys; // raw partition values, in key order
+  shared_ptr<parquet::FileMetaData> meta;
+  vector<int> index; // leaf column index of each file column, -1 if unread
+  vector<int> row_groups;
+  int64_t offset = 0, rows = 0;
+};
+struct ReadRequest {
+  filesystem::path path;
+  vector<string> columns;
+  vector<Condition> filter;
+  vector<string> keys;
+  vector<ReadFile> files;
+  vector<ReadColumn> cols;
+};
+string uri_decode(const string& s) {
+  string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) &&
+        isxdigit(s[i + 2])) {
+      out += char(stoi(s.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+// Parses YYYY-MM-DD as days since 2000.01.01
+bool parse_date(const string& s, I& days) {
+  int y, m, d;
+  char tail;
+  if (s.size() != 10 || sscanf(s.c_str(), "%4d-%2d-%2d%c", &y, &m, &d,
+                               &tail) != 3) {
+    return false;
+  }
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  days = era * 146097 + doe - 719468 - 10957;
+  return true;
+}
+// Lists the files under the path, recovering partition keys from Hive
+// key=value directories
+Status list_files(ReadRequest& req) {
+  error_code ec;
+  if (!filesystem::is_directory(req.path, ec)) {
+    ReadFile f;
+    f.path = req.path.string();
+    req.files.push_back(move(f));
+    return Status::OK();
+  }
+  vector<filesystem::path> paths;
+  for (auto& e : filesystem::recursive_directory_iterator(req.path, ec)) {
+    string name = e.path().filename().string();
+    if (e.is_regular_file() && name[0] != '.' && name[0] != '_')
+      paths.push_back(e.path());
+  }
+  if (ec) return Status::IOError(ec.message());
+  if (paths.empty()) {
+    return Status::Invalid("no files under " + req.path.string());
+  }
+  sort(paths.begin(), paths.end());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    ReadFile f;
+    f.path = paths[i].string();
+    vector<string> names;
+    for (auto& seg : paths[i].parent_path().lexically_relative(req.path)) {
+      string s = seg.string();
+      size_t eq = s.find('=');
+      if (eq == string::npos) continue;
+      names.push_back(uri_decode(s.substr(0, eq)));
+      f.keys.push_back(uri_decode(s.substr(eq + 1)));
+    }
+    if (i == 0) {
+      req.keys = names;
+    } else if (names != req.keys) {
+      return Status::Invalid("inconsistent partitioning under " +
+                             req.path.string());
+    }
+    req.files.push_back(move(f));
+  }
+  return Status::OK();
+}
+// Infers the type of each partition key: date, long, float, else symbol
+void key_types(ReadRequest& req) {
+  for (auto& c : req.cols) {
+    if (c.key < 0) continue;
+    bool date = true, integer = true, real = true;
+    for (auto& f : req.files) {
+      const string& s = f.keys[c.key];
+      if (s == hive_null) continue;
+      I d;
+      char* end;
+      date = date && parse_date(s, d);
+      integer = integer && (strtoll(s.c_str(), &end, 10), *end == 0);
+      real = real && (strtod(s.c_str(), &end), *end == 0);
+    }
+    c.type = date ? KD : (integer ? KJ : (real ? KF : KS));
+  }
+}
+Value key_value(const ReadColumn& c, const string& s) {
+  Value v;
+  v.kind = kind_of(c.type);
+  bool null = s == hive_null;
+  I d;
+  switch (c.type) {
+    case KD:
+      v.j = null || !parse_date(s, d) ? ni : d;
+      break;
+    case KJ:
+      v.j = null ? nj : strtoll(s.c_str(), nullptr, 10);
+      break;
+    case KF:
+      v.f = null ? -INFINITY : strtod(s.c_str(), nullptr);
+      break;
+    default:
+      v.s = null ? string_view() : string_view(s);
+  }
+  return v;
+}
+// Maps a Parquet leaf column to the kdb+ type it is read as
+Status column_type(const parquet::ColumnDescriptor* d, ReadColumn& c) {
+  if (d->max_repetition_level() > 0) {
+    return Status::Invalid("nested column " + c.name);
+  }
+  auto lt = d->logical_type();
+  auto unit_mul = [](parquet::LogicalType::TimeUnit::unit u) -> J {
+    return u == parquet::LogicalType::TimeUnit::MILLIS
+               ? 1000000
+               : (u == parquet::LogicalType::TimeUnit::MICROS ? 1000 : 1);
+  };
+  c.mul = 1;
+  c.offset = 0;
+  switch (d->physical_type()) {
+    case parquet::Type::BOOLEAN:
+      c.type = KB;
+      break;
+    case parquet::Type::INT32:
+      if (lt->is_date()) {
+        c.type = KD;
+        c.offset = 10957;
+      } else if (lt->is_time()) {
+        c.type = KT;
+      } else if (lt->is_int() &&
+                 static_cast<const parquet::IntLogicalType&>(*lt).bit_width() <=
+                     16) {
+        c.type = KH;
+      } else {
+        c.type = KI;
+      }
+      break;
+    case parquet::Type::INT64:
+      if (lt->is_timestamp()) {
+        c.type = KP;
+        c.mul = unit_mul(
+            static_cast<const parquet::TimestampLogicalType&>(*lt).time_unit());
+        c.offset = 946684800000000000LL;
+      } else if (lt->is_time()) {
+        c.type = KN;
+        c.mul = unit_mul(
+            static_cast<const parquet::TimeLogicalType&>(*lt).time_unit());
+      } else {
+        c.type = KJ;
+      }
+      break;
+    case parquet::Type::FLOAT:
+      c.type = KE;
+      break;
+    case parquet::Type::DOUBLE:
+      c.type = KF;
+      break;
+    case parquet::Type::BYTE_ARRAY:
+      c.type = KS;
+      break;
+    default:
+      return Status::NotImplemented("unsupported Parquet type for column " +
+                                    c.name);
+  }
+  return Status::OK();
+}
+// Converts row group min/max statistics to q values
+bool stats_range(const parquet::Statistics& stats, const ReadColumn& c,
+                 Value& min, Value& max, string& min_s, string& max_s) {
+  min.kind = max.kind = kind_of(c.type);
+  switch (stats.physical_type()) {
+    case parquet::Type::BOOLEAN: {
+      auto& s = static_cast<const parquet::BoolStatistics&>(stats);
+      min.j = s.min(), max.j = s.max();
+      break;
+    }
+    case parquet::Type::INT32: {
+      auto& s = static_cast<const parquet::Int32Statistics&>(stats);
+      min.j = s.min() * c.mul - c.offset, max.j = s.max() * c.mul - c.offset;
+      break;
+    }
+    case parquet::Type::INT64: {
+      auto& s = static_cast<const parquet::Int64Statistics&>(stats);
+      min.j = s.min() * c.mul - c.offset, max.j = s.max() * c.mul - c.offset;
+      break;
+    }
+    case parquet::Type::FLOAT: {
+      auto& s = static_cast<const parquet::FloatStatistics&>(stats);
+      min.f = s.min(), max.f = s.max();
+      break;
+    }
+    case parquet::Type::DOUBLE: {
+      auto& s = static_cast<const parquet::DoubleStatistics&>(stats);
+      min.f = s.min(), max.f = s.max();
+      break;
+    }
+    case parquet::Type::BYTE_ARRAY: {
+      auto& s = static_cast<const parquet::ByteArrayStatistics&>(stats);
+      min_s = parquet::ByteArrayToString(s.min());
+      max_s = parquet::ByteArrayToString(s.max());
+      min.s = min_s, max.s = max_s;
+      break;
+    }
+    default:
+      return false;
+  }
+  return true;
+}
+Value null_value(const ReadColumn& c) {
+  Value v;
+  v.kind = kind_of(c.type);
+  v.j = c.type == KH ? nh : (c.type == KJ || c.type == KP || c.type == KN)
+                                ? nj
+                                : (c.type == KB ? 0 : ni);
+  v.f = -INFINITY;
+  return v;
+}
+// Temporal types convert to one another only within a family: points in
+// time, times of day and spans, or months
+int temporal_family(signed char t) {
+  switch (t) {
+    case KP:
+    case KD:
+      return 1;
+    case KN:
+    case KT:
+    case KU:
+    case KV:
+      return 2;
+    case KM:
+      return 3;
+    default:
+      return 0;
+  }
+}
+J unit_ns(signed char t) {
+  switch (t) {
+    case KD:
+      return 86400000000000LL;
+    case KT:
+      return 1000000;
+    case KU:
+      return 60000000000LL;
+    case KV:
+      return 1000000000;
+    default:
+      return 1;
+  }
+}
+// Brings a filter value of q type t to the unit of column c, e.g. a date to
+// nanoseconds for a timestamp column. Fails for values that would lose
+// precision or mix temporal and plain numbers.
+bool convert_filter_value(signed char t, const ReadColumn& c, Value& v) {
+  if (t == c.type) return true;
+  int family = temporal_family(t);
+  if (family != temporal_family(c.type)) return false;
+  if (!family) return true;
+  if (family == 3 || unit_ns(t) % unit_ns(c.type)) return false;
+  bool wide = t == KP || t == KN;
+  J null = wide ? nj : ni, inf = wide ? wj : wi;
+  bool c_wide = c.type == KP || c.type == KN;
+  if (v.j == null) {
+    v.j = c_wide ? nj : ni;
+  } else if (v.j == inf || v.j == -inf) {
+    v.j = (v.j > 0 ? 1 : -1) * (c_wide ? wj : wi);
+  } else {
+    v.j *= unit_ns(t) / unit_ns(c.type);
+  }
+  return true;
+}
+// Keeps the row groups whose statistics can satisfy every filter condition
+void prune_row_groups(const ReadRequest& req, ReadFile& f) {
+  for (int rg = 0; rg < f.meta->num_row_groups(); ++rg) {
+    auto meta = f.meta->RowGroup(rg);
+    bool keep = true;
+    for (auto& cond : req.filter) {
+      for (size_t c = 0; keep && c < req.cols.size(); ++c) {
+        const ReadColumn& col = req.cols[c];
+        if (col.key >= 0 || col.name != cond.col) continue;
+        auto chunk = meta->ColumnChunk(f.index[c]);
+        auto stats = chunk->statistics();
+        Value min, max;
+        string min_s, max_s;
+        if (!chunk->is_stats_set() || !stats || !stats->HasMinMax() ||
+            !stats_range(*stats, col, min, max, min_s, max_s)) {
+          continue;
+        }
+        bool nulls = !stats->HasNullCount() || stats->null_count() > 0;
+        keep = may_match(cond, min, max) ||
+               (nulls && matches(cond, null_value(col)));
+      }
+    }
+    if (keep) {
+      f.row_groups.push_back(rg);
+      f.rows += meta->num_rows();
+    }
+  }
+}
+Status parse_read_request(K path, K columns, K filter, ReadRequest& req) {
+  if (path->t != -KS) {
+    return Status::Invalid("path not a symbol");
+  }
+  req.path = path->s;
+  if (columns->t == -KS) {
+    if (columns->s[0]) req.columns.push_back(columns->s);
+  } else if (columns->t == KS) {
+    for (J i = 0; i < columns->n; ++i) req.columns.push_back(kS(columns)[i]);
+  } else if (columns->t != 0 || columns->n != 0) {
+    return Status::Invalid("columns not a symbol or symbol list");
+  }
+  if (filter->t == 0 && filter->n > 0) {
+    bool single = kK(filter)[0]->t == -KS;
+    for (J i = 0; i < (single ? 1 : filter->n); ++i) {
+      Condition c;
+      ARROW_RETURN_NOT_OK(parse_condition(single ? filter : kK(filter)[i], c));
+      req.filter.push_back(move(c));
+    }
+  } else if (filter->t != 101 && (filter->t != 0 || filter->n != 0)) {
+    return Status::Invalid("filter not a list of (op;column;value)");
+  }
+  ARROW_RETURN_NOT_OK(list_files(req));
+  // The first file's schema defines the file columns
+  PARQUET_CATCH_NOT_OK(
+      req.files[0].meta =
+          parquet::ParquetFileReader::OpenFile(req.files[0].path)->metadata());
+  auto schema = req.files[0].meta->schema();
+  for (int i = 0; i < schema->num_columns(); ++i) {
+    ReadColumn c;
+    c.name = schema->Column(i)->path()->ToDotString();
+    Status st = column_type(schema->Column(i), c);
+    if (!st.ok()) {
+      // a nested column is named by its top-level field, once
+      c.name = schema->Column(i)->path()->ToDotVector()[0];
+      c.unsupported = st.message();
+      if (!req.cols.empty() && req.cols.back().name == c.name) continue;
+    }
+    req.cols.push_back(move(c));
+  }
+  for (size_t k = 0; k < req.keys.size(); ++k) {
+    if (schema->ColumnIndex(req.keys[k]) >= 0) continue;
+    ReadColumn c;
+    c.name = req.keys[k];
+    c.key = k;
+    req.cols.push_back(move(c));
+  }
+  key_types(req);
+  for (auto& name : req.columns) {
+    auto it = find_if(req.cols.begin(), req.cols.end(),
+                      [&](const ReadColumn& c) { return c.name == name; });
+    if (it == req.cols.end()) return Status::Invalid("no column " + name);
+    if (it->projected) return Status::Invalid("duplicate column " + name);
+    it->projected = true;
+  }
+  for (auto& c : req.cols) {
+    if (req.columns.empty()) c.projected = true;
+    if (c.projected && !c.unsupported.empty()) {
+      return Status::NotImplemented(c.unsupported);
+    }
+  }
+  for (auto& cond : req.filter) {
+    auto it = find_if(req.cols.begin(), req.cols.end(),
+                      [&](const ReadColumn& c) { return c.name == cond.col; });
+    if (it == req.cols.end()) return Status::Invalid("no column " + cond.col);
+    if (!it->unsupported.empty()) {
+      return Status::NotImplemented(it->unsupported);
+    }
+    it->filtered = true;
+    for (size_t i = 0; i < cond.values.size(); ++i) {
+      Value& v = cond.values[i];
+      if ((v.kind == Value::symbol) != (it->type == KS) ||
+          !convert_filter_value(cond.types[i], *it, v)) {
+        return Status::Invalid("filter value type mismatch for " + cond.col);
+      }
+    }
+  }
+  return Status::OK();
+}
+// Drops files whose partition keys fail the filter, then row groups whose
+// statistics do; records where each file's rows land in the result
+Status plan_read(ReadRequest& req) {
+  int64_t offset = 0;
+  for (auto& f : req.files) {
+    bool keep = true;
+    for (auto& cond : req.filter) {
+      for (auto& c : req.cols) {
+        if (c.key >= 0 && c.name == cond.col)
+          keep = keep && matches(cond, key_value(c, f.keys[c.key]));
+      }
+    }
+    if (!keep) continue;
+    if (!f.meta) {
+      PARQUET_CATCH_NOT_OK(
+          f.meta = parquet::ParquetFileReader::OpenFile(f.path)->metadata());
+    }
+    for (auto& c : req.cols) {
+      if (c.key >= 0) continue;
+      // columns that are not decoded need not exist or match
+      if (!c.projected && !c.filtered) {
+        f.index.push_back(-1);
+        continue;
+      }
+      int i = f.meta->schema()->ColumnIndex(c.name);
+      if (i < 0) return Status::Invalid(f.path + " has no column " + c.name);
+      ReadColumn check;
+      check.name = c.name;
+      ARROW_RETURN_NOT_OK(column_type(f.meta->schema()->Column(i), check));
+      if (check.type != c.type || check.mul != c.mul) {
+        return Status::Invalid(f.path + " has a different type for " + c.name);
+      }
+      f.index.push_back(i);
+    }
+    prune_row_groups(req, f);
+    f.offset = offset;
+    offset += f.rows;
+  }
+  // Key columns are only filled in when projected
+  for (auto& c : req.cols) {
+    if (c.projected || (c.filtered && c.key < 0)) {
+      c.values = ktn(c.type, offset);
+    }
+  }
+  return Status::OK();
+}
+// Decodes `rows` values of a flat column into `out`, spreading nulls as the q
+// sentinel. Values land directly in the kdb+ vector when the physical type has
+// the same width.
+template <typename DType, typename T>
+void read_values(parquet::ColumnReader& column, int16_t max_def, int64_t rows,
+                 J mul, J offset, T null, T* out) {
+  using P = typename DType::c_type;
+  constexpr bool direct = sizeof(P) == sizeof(T);
+  const int64_t batch = 64 * 1024;
+  auto& reader = static_cast<parquet::TypedColumnReader<DType>&>(column);
+  vector<int16_t> def(max_def > 0 ? batch : 0);
+  vector<P> buf(direct ? 0 : batch);
+  for (int64_t pos = 0; pos < rows;) {
+    int64_t values = 0;
+    P* dst = (P*)(out + pos);
+    if constexpr (!direct) dst = buf.data();
+    int64_t levels =
+        reader.ReadBatch(min(batch, rows - pos),
+                         def.empty() ? nullptr : def.data(), nullptr, dst,
+                         &values);
+    if (levels == 0) throw parquet::ParquetException("truncated column");
+    if constexpr (!direct) {
+      for (int64_t i = 0; i < values; ++i) out[pos + i] = T(buf[i]);
+    }
+    if (mul != 1 || offset != 0) {
+      for (int64_t i = 0; i < values; ++i)
+        out[pos + i] = out[pos + i] * mul - offset;
+    }
+    for (int64_t i = levels - 1, j = values - 1; i > j; --i) {
+      out[pos + i] = def[i] == max_def ? out[pos + j--] : null;
+    }
+    pos += levels;
+  }
+}
+// String columns are interned as symbols, which must happen on the q thread
+void read_symbols(parquet::ColumnReader& column, int16_t max_def, int64_t rows,
+                  S* out) {
+  const int64_t batch = 64 * 1024;
+  auto& reader = static_cast<parquet::ByteArrayReader&>(column);
+  vector<int16_t> def(max_def > 0 ? batch : 0);
+  vector<parquet::ByteArray> buf(batch);
+  S null = ss((S) "");
+  for (int64_t pos = 0; pos < rows;) {
+    int64_t values = 0;
+    int64_t levels =
+        reader.ReadBatch(min(batch, rows - pos),
+                         def.empty() ? nullptr : def.data(), nullptr,
+                         buf.data(), &values);
+    if (levels == 0) throw parquet::ParquetException("truncated column");
+    for (int64_t i = 0, j = 0; i < levels; ++i) {
+      if (max_def > 0 && def[i] < max_def) {
+        out[pos + i] = null;
+      } else {
+        out[pos + i] = sn((S)buf[j].ptr, buf[j].len);
+        ++j;
+      }
+    }
+    pos += levels;
+  }
+}
+void read_chunk(parquet::RowGroupReader& rg, int index, const ReadColumn& c,
+                int64_t pos, int64_t rows) {
+  auto column = rg.Column(index);
+  int16_t max_def = column->descr()->max_definition_level();
+  K x = c.values;
+  switch (c.type) {
+    case KB:
+      read_values<parquet::BooleanType>(*column, max_def, rows, 1, 0, G(0),
+                                        kG(x) + pos);
+      break;
+    case KH:
+      read_values<parquet::Int32Type>(*column, max_def, rows, 1, 0, H(nh),
+                                      kH(x) + pos);
+      break;
+    case KI:
+    case KD:
+    case KT:
+      read_values<parquet::Int32Type>(*column, max_def, rows, c.mul, c.offset,
+                                      I(ni), kI(x) + pos);
+      break;
+    case KJ:
+    case KP:
+    case KN:
+      read_values<parquet::Int64Type>(*column, max_def, rows, c.mul, c.offset,
+                                      J(nj), kJ(x) + pos);
+      break;
+    case KE:
+      read_values<parquet::FloatType>(*column, max_def, rows, 1, 0, E(nf),
+                                      kE(x) + pos);
+      break;
+    case KF:
+      read_values<parquet::DoubleType>(*column, max_def, rows, 1, 0, F(nf),
+                                       kF(x) + pos);
+      break;
+    case KS:
+      read_symbols(*column, max_def, rows, kS(x) + pos);
+      break;
+  }
+}
+Status read_file(ReadRequest& req, const ReadFile& f) {
+  unique_ptr<parquet::ParquetFileReader> reader;
+  PARQUET_CATCH_NOT_OK(reader = parquet::ParquetFileReader::OpenFile(
+                           f.path, false, parquet::default_reader_properties(),
+                           f.meta));
+  // Only columns that are projected or filtered on need decoding
+  vector<size_t> file_cols;
+  for (size_t c = 0; c < req.cols.size(); ++c) {
+    ReadColumn& col = req.cols[c];
+    if (col.key < 0 && (col.projected || col.filtered)) file_cols.push_back(c);
+  }
+  auto read = [&](size_t c) -> Status {
+    PARQUET_CATCH_NOT_OK({
+      int64_t pos = f.offset;
+      for (int rg : f.row_groups) {
+        auto rg_reader = reader->RowGroup(rg);
+        int64_t rows = rg_reader->metadata()->num_rows();
+        read_chunk(*rg_reader, f.index[c], req.cols[c], pos, rows);
+        pos += rows;
+      }
+    });
+    return Status::OK();
+  };
+  // Fixed-width columns decode in parallel, symbols on the q thread
+  vector<size_t> fixed;
+  copy_if(file_cols.begin(), file_cols.end(), back_inserter(fixed),
+          [&](size_t c) { return req.cols[c].type != KS; });
+  ARROW_RETURN_NOT_OK(internal::OptionalParallelFor(
+      fixed.size() > 1, fixed.size(), [&](int i) { return read(fixed[i]); }));
+  for (size_t c : file_cols) {
+    if (req.cols[c].type == KS) ARROW_RETURN_NOT_OK(read(c));
+  }
+  for (auto& c : req.cols) {
+    if (c.key < 0 || !c.projected) continue;
+    Value v = key_value(c, f.keys[c.key]);
+    for (int64_t i = f.offset; i < f.offset + f.rows; ++i) {
+      switch (c.type) {
+        case KD:
+          kI(c.values)[i] = v.j;
+          break;
+        case KJ:
+          kJ(c.values)[i] = v.j;
+          break;
+        case KF:
+          kF(c.values)[i] = v.f == -INFINITY ? nf : v.f;
+          break;
+        default:
+          kS(c.values)[i] = sn((S)v.s.data(), v.s.size());
+      }
+    }
+  }
+  return Status::OK();
+}
+// Applies the filter row by row to what survived pruning, compacting the
+// columns in place
+void filter_rows(ReadRequest& req) {
+  vector<pair<const Condition*, K>> conds;
+  for (auto& cond : req.filter) {
+    for (auto& c : req.cols) {
+      if (c.key < 0 && c.name == cond.col) conds.push_back({&cond, c.values});
+    }
+  }
+  if (conds.empty()) return;
+  J n = conds[0].second->n, kept = 0;
+  vector<J> keep;
+  keep.reserve(n);
+  Value v;
+  for (J i = 0; i < n; ++i) {
+    bool ok = true;
+    for (auto& [cond, x] : conds) {
+      ok = ok && value_at(x, i, v) && matches(*cond, v);
+    }
+    if (ok) keep.push_back(i);
+  }
+  kept = keep.size();
+  if (kept == n) return;
+  for (auto& c : req.cols) {
+    K x = c.values;
+    if (!x) continue;
+    size_t size = x->t == KB ? 1 : x->t == KH ? 2 : 8;
+    if (x->t == KI || x->t == KD || x->t == KT || x->t == KE) size = 4;
+    for (J i = 0; i < kept; ++i) {
+      memmove(kG(x) + i * size, kG(x) + keep[i] * size, size);
+    }
+    x->n = kept;
+  }
+}
+Status read_table(ReadRequest& req, K& table) {
+  ARROW_RETURN_NOT_OK(plan_read(req));
+  for (auto& f : req.files) {
+    if (f.rows > 0) ARROW_RETURN_NOT_OK(read_file(req, f));
+  }
+  filter_rows(req);
+  vector<ReadColumn*> order;
+  for (auto& c : req.cols) {
+    if (req.columns.empty()) order.push_back(&c);
+  }
+  for (auto& name : req.columns) {
+    for (auto& c : req.cols) {
+      if (c.name == name) order.push_back(&c);
+    }
+  }
+  K names = ktn(KS, 0), values = ktn(0, 0);
+  for (ReadColumn* c : order) {
+    js(&names, ss((S)c->name.c_str()));
+    jk(&values, c->values);
+    c->values = nullptr;
+  }
+  table = xT(xD(names, values));
+  return Status::OK();
+}
+} // namespace
+extern "C" K read_parquet(K path, K columns, K filter) {
+  static string k_err;
+  Status status;
+  ReadRequest req;
+  CHECK_STATUS(parse_read_request(path, columns, filter, req));
+  K table = nullptr;
+  status = read_table(req, table);
+  for (auto& c : req.cols) {
+    if (c.values) r0(c.values);
+  }
+  CHECK_STATUS(status);
+  return table;
+}
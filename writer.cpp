@@ -1,14 +1,37 @@
 #include <arrow/api.h>
+#include <arrow/c/bridge.h>
 #include <arrow/dataset/api.h>
+#include <arrow/filesystem/localfs.h>
+#include <arrow/filesystem/mockfs.h>
 #include <arrow/io/api.h>
 #include <arrow/result.h>
 #include <arrow/util/logging.h>
+#include <algorithm>
+#include <arrow/util/parallel.h>
+#include <atomic>
+#include <cerrno>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include "kernels.h"
+#include <parquet/api/reader.h>
 #include <parquet/arrow/writer.h>
 #include <set>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_set>
 extern "C" {
 #include "k.h"
 }
@@ -18,16 +41,35 @@ using namespace std;
   {                                                                            \
     shared_ptr<Array> array;                                                   \
     ARROW_RETURN_NOT_OK(builder.Finish(&array));                               \
-    arrays.push_back(array);                                                   \
-    fields.push_back(field(col_name, arrow_type_expr));                        \
+    arrays[c] = array;                                                         \
+    fields[c] = field(col_name, arrow_type_expr);                              \
   }
-#define APPEND_VALUE(value, null_expr)                                         \
+#define APPEND_FIXED(col, arrow_type_expr, c_type, kernel)                     \
   {                                                                            \
-    if (value == null_expr) {                                                  \
-      ARROW_RETURN_NOT_OK(builder.AppendNull());                               \
-    } else {                                                                   \
-      ARROW_RETURN_NOT_OK(builder.Append(value));                              \
-    }                                                                          \
+    shared_ptr<Array> array;                                                   \
+    ARROW_RETURN_NOT_OK(fixed_width_array<c_type>(                             \
+        col, offset, length, arrow_type_expr, ctx.opts.zero_copy, kernel,      \
+        ctx.memory_pool, array));                                              \
+    arrays[c] = array;                                                         \
+    fields[c] = field(col_name, arrow_type_expr);                              \
+  }
+#define APPEND_SHIFTED(col, arrow_type_expr, c_type, kernel, operand)          \
+  {                                                                            \
+    shared_ptr<Array> array;                                                   \
+    ARROW_RETURN_NOT_OK(shifted_array<c_type>(                                 \
+        col, offset, length, arrow_type_expr, operand, kernel,                 \
+        ctx.memory_pool, array));                                              \
+    arrays[c] = array;                                                         \
+    fields[c] = field(col_name, arrow_type_expr);                              \
+  }
+#define APPEND_LIST(items, item_type, c_type, arrow_type_expr, kernel)         \
+  {                                                                            \
+    shared_ptr<Array> array;                                                   \
+    ARROW_RETURN_NOT_OK(list_array<c_type>(items, length, item_type,           \
+                                           arrow_type_expr, kernel,            \
+                                           ctx.memory_pool, array));           \
+    arrays[c] = array;                                                         \
+    fields[c] = field(col_name, array->type());                                \
   }
 #define CHECK_STATUS(expr)                                                     \
   {                                                                            \
@@ -48,193 +90,1760 @@ bool is_in(const char* symbol, K symbol_list) {
   }
   return false;
 }
-static const set<string> allowed_options = {"use_threads",  "enable_dict",
-                                            "disable_dict", "chunk_size",
-                                            "store_schema", "compression"};
-Status kdb_to_arrow(shared_ptr<Table>& arrow_table, K table) {
+static const set<string> allowed_options = {
+    "use_threads", "enable_dict", "disable_dict", "chunk_size", "store_schema",
+    "compression", "zero_copy",   "streaming",    "conversion_threads",
+    "partition_threads", "memory_budget", "stats", "memory_pool",
+    "max_memory", "large_strings", "encoding", "column_compression",
+    "compression_level", "sorting_columns", "page_index", "bloom_filter",
+    "write_buffer", "direct_io", "atomic", "fsync", "prefetch", "sort_by"};
+// How files are written, for FileSink
+struct OutputOptions {
+  enum class Sync { none, file, all };
+  int64_t write_buffer = 0; // bytes, 0 for the default
+  bool direct_io = false;   // O_DIRECT, or buffered writes if unsupported
+  bool atomic = false;      // write a hidden temporary file, then rename it
+  Sync fsync = Sync::none;  // all also syncs the directory after the rename
+  // Arrow's own file stream is used unless one of these is set
+  bool custom() const {
+    return write_buffer || direct_io || atomic || fsync != Sync::none;
+  }
+};
+struct ConvertOptions {
+  bool zero_copy = false; // wrap kdb vectors instead of copying them
+  bool streaming = false; // convert and write one row group at a time
+  int64_t chunk_size = parquet::DEFAULT_MAX_ROW_GROUP_LENGTH;
+  int conversion_threads = 1; // 0 uses Arrow's CPU thread pool
+  bool stats = false;         // return timings and sizes to q
+  MemoryPool* memory_pool = default_memory_pool();
+  int64_t max_memory = 0; // bytes, 0 for no limit
+  bool large_strings = false; // int64 string offsets
+  bool sort_check = false;     // find the sort keys from the data
+  vector<string> sorting_columns; // declared sort keys, checked
+  vector<string> sort_by;         // columns the rows are sorted by on write
+  OutputOptions output;
+  int64_t prefetch = 0; // bytes read ahead of conversion, 0 for none
+};
+// Option values come as a general list, or as a simple list when all of them
+// share a type
+bool opt_bool(K vals, size_t i, bool& value) {
+  if (vals->t == KB) {
+    value = static_cast<bool>(kG(vals)[i]);
+  } else if (vals->t == 0 && kK(vals)[i]->t == -KB) {
+    value = static_cast<bool>(kK(vals)[i]->g);
+  } else {
+    return false;
+  }
+  return true;
+}
+bool opt_long(K vals, size_t i, J& value) {
+  if (vals->t == KJ) {
+    value = kJ(vals)[i];
+  } else if (vals->t == 0 && kK(vals)[i]->t == -KJ) {
+    value = kK(vals)[i]->j;
+  } else {
+    return false;
+  }
+  return true;
+}
+bool opt_symbol(K vals, size_t i, string& value) {
+  if (vals->t == KS) {
+    value = kS(vals)[i];
+  } else if (vals->t == 0 && kK(vals)[i]->t == -KS) {
+    value = kK(vals)[i]->s;
+  } else {
+    return false;
+  }
+  return true;
+}
+// A symbol or symbol list
+bool opt_symbols(K vals, size_t i, vector<string>& values) {
+  string value;
+  if (opt_symbol(vals, i, value)) {
+    values = {value};
+  } else if (vals->t == 0 && kK(vals)[i]->t == KS) {
+    values.assign(kS(kK(vals)[i]), kS(kK(vals)[i]) + kK(vals)[i]->n);
+  } else {
+    return false;
+  }
+  return true;
+}
+// Arrow buffer pointing into a kdb vector. The vector is pinned with r1 for
+// as long as Arrow holds the buffer.
+class KBuffer : public Buffer {
+public:
+  KBuffer(K k, const uint8_t* data, int64_t size) : Buffer(data, size) {
+    lock_guard<mutex> lock(ref_mutex);
+    k_ = r1(k);
+  }
+  ~KBuffer() override {
+    lock_guard<mutex> lock(ref_mutex);
+    r0(k_);
+  }
+
+private:
+  // r1/r0 are not atomic and columns are wrapped from conversion threads
+  static inline mutex ref_mutex;
+  K k_;
+};
+// Memory pool that keeps freed buffers for the next allocation of the same
+// size class instead of returning them, so that a writer session converts
+// each batch into memory that is already mapped. Sizes are rounded up to
+// powers of two so batches of varying length still reuse buffers, and the
+// cache never holds more than the peak in use.
+class RecyclingPool : public MemoryPool {
+public:
+  explicit RecyclingPool(MemoryPool* base = default_memory_pool())
+      : base_(base) {}
+  ~RecyclingPool() override {
+    for (auto& [key, buffers] : free_) {
+      for (uint8_t* buffer : buffers) {
+        base_->Free(buffer, key.first, key.second);
+      }
+    }
+  }
+  Status Allocate(int64_t size, int64_t alignment, uint8_t** out) override {
+    if (size == 0) return base_->Allocate(size, alignment, out);
+    int64_t cls = size_class(size);
+    {
+      lock_guard<mutex> lock(mutex_);
+      auto& buffers = free_[{cls, alignment}];
+      if (!buffers.empty()) {
+        *out = buffers.back();
+        buffers.pop_back();
+        cached_ -= cls;
+        in_use(cls);
+        return Status::OK();
+      }
+    }
+    ARROW_RETURN_NOT_OK(base_->Allocate(cls, alignment, out));
+    lock_guard<mutex> lock(mutex_);
+    in_use(cls);
+    return Status::OK();
+  }
+  Status Reallocate(int64_t old_size, int64_t new_size, int64_t alignment,
+                    uint8_t** ptr) override {
+    if (old_size && new_size && size_class(old_size) == size_class(new_size))
+      return Status::OK();
+    uint8_t* out;
+    ARROW_RETURN_NOT_OK(Allocate(new_size, alignment, &out));
+    memcpy(out, *ptr, min(old_size, new_size));
+    Free(*ptr, old_size, alignment);
+    *ptr = out;
+    return Status::OK();
+  }
+  void Free(uint8_t* buffer, int64_t size, int64_t alignment) override {
+    if (size == 0) return base_->Free(buffer, size, alignment);
+    int64_t cls = size_class(size);
+    {
+      lock_guard<mutex> lock(mutex_);
+      used_ -= cls;
+      if (cached_ + cls <= peak_) {
+        free_[{cls, alignment}].push_back(buffer);
+        cached_ += cls;
+        return;
+      }
+    }
+    base_->Free(buffer, cls, alignment);
+  }
+  int64_t bytes_allocated() const override { return used_; }
+  int64_t max_memory() const override { return peak_; }
+  int64_t total_bytes_allocated() const override { return total_; }
+  int64_t num_allocations() const override { return allocations_; }
+  string backend_name() const override { return base_->backend_name(); }
+
+private:
+  static int64_t size_class(int64_t size) {
+    int64_t cls = 4096;
+    while (cls < size) cls <<= 1;
+    return cls;
+  }
+  void in_use(int64_t cls) {
+    used_ += cls;
+    peak_ = max(peak_.load(), used_.load());
+    total_ += cls;
+    ++allocations_;
+  }
+  MemoryPool* base_;
+  mutex mutex_;
+  std::map<pair<int64_t, int64_t>, vector<uint8_t*>> free_;
+  atomic<int64_t> used_{0}, peak_{0}, total_{0}, allocations_{0};
+  int64_t cached_ = 0;
+};
+// Backing pool named by the memory_pool option. The arena keeps conversion
+// buffers between calls; it is never destroyed, as its buffers may outlive
+// Arrow's own pools at exit.
+Status named_pool(const string& name, MemoryPool*& pool) {
+  if (name == "default") {
+    pool = default_memory_pool();
+  } else if (name == "system") {
+    pool = system_memory_pool();
+  } else if (name == "jemalloc") {
+    return jemalloc_memory_pool(&pool);
+  } else if (name == "mimalloc") {
+    return mimalloc_memory_pool(&pool);
+  } else if (name == "arena") {
+    static RecyclingPool* arena = new RecyclingPool();
+    pool = arena;
+  } else {
+    return Status::Invalid("Unsupported memory_pool: " + name);
+  }
+  return Status::OK();
+}
+// Fixed-width vector whose kdb layout matches the Arrow value buffer. The
+// validity bitmap is dropped when the vector has no nulls.
+template <typename T>
+Status fixed_width_array(K col, int64_t offset, int64_t length,
+                         const shared_ptr<DataType>& type, bool zero_copy,
+                         int64_t (*kernel)(const T*, int64_t, uint8_t*),
+                         MemoryPool* pool, shared_ptr<Array>& array) {
+  const T* values = reinterpret_cast<const T*>(kG(col)) + offset;
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  int64_t null_count = kernel(values, length, bitmap->mutable_data());
+  if (!null_count) bitmap.reset();
+  if (zero_copy) {
+    data = make_shared<KBuffer>(col, reinterpret_cast<const uint8_t*>(values),
+                                length * sizeof(T));
+  } else {
+    ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(length * sizeof(T), pool));
+    memcpy(data->mutable_data(), values, length * sizeof(T));
+  }
+  array = MakeArray(ArrayData::Make(type, length, {bitmap, data}, null_count));
+  return Status::OK();
+}
+// Fixed-width vector that needs an epoch shift or a unit rescale, written
+// into one preallocated buffer in the same pass as the null scan
+template <typename T>
+Status shifted_array(K col, int64_t offset, int64_t length,
+                     const shared_ptr<DataType>& type, T operand,
+                     int64_t (*kernel)(const T*, int64_t, T, T*, uint8_t*),
+                     MemoryPool* pool, shared_ptr<Array>& array) {
+  const T* values = reinterpret_cast<const T*>(kG(col)) + offset;
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(length * sizeof(T), pool));
+  int64_t null_count = kernel(values, length, operand,
+                              data->mutable_data_as<T>(),
+                              bitmap->mutable_data());
+  if (!null_count) bitmap.reset();
+  array = MakeArray(ArrayData::Make(type, length, {bitmap, data}, null_count));
+  return Status::OK();
+}
+int64_t clock_ns(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+// Nanoseconds spent in one phase of a write, summed over its calls
+struct PhaseTime {
+  atomic<int64_t> wall{0}, cpu{0};
+};
+// Pool counting the allocations of one write, and enforcing max_memory. An
+// allocation that would go over the limit waits for other threads
+// (encoders, partition writers) to free memory, and fails once nothing has
+// been freed for a second rather than growing the process. Arrow can free a
+// write's last buffers after the write has returned (the dataset writer
+// releases its file writers on its own threads), so while any bytes are
+// allocated the pool holds a reference to itself rather than depending on
+// the write's lifetime. Create with make_shared.
+class WritePool : public MemoryPool,
+                  public enable_shared_from_this<WritePool> {
+public:
+  // limit 0 for none
+  WritePool(MemoryPool* base, int64_t limit) : base_(base), limit_(limit) {}
+  Status Allocate(int64_t size, int64_t alignment, uint8_t** out) override {
+    ARROW_RETURN_NOT_OK(reserve(size));
+    Status st = base_->Allocate(size, alignment, out);
+    if (!st.ok()) release(size);
+    return st;
+  }
+  Status Reallocate(int64_t old_size, int64_t new_size, int64_t alignment,
+                    uint8_t** ptr) override {
+    if (new_size > old_size) {
+      ARROW_RETURN_NOT_OK(reserve(new_size - old_size));
+    }
+    Status st = base_->Reallocate(old_size, new_size, alignment, ptr);
+    if (new_size > old_size && !st.ok()) release(new_size - old_size);
+    if (new_size < old_size && st.ok()) release(old_size - new_size);
+    return st;
+  }
+  void Free(uint8_t* buffer, int64_t size, int64_t alignment) override {
+    base_->Free(buffer, size, alignment);
+    release(size); // can free the pool, so last
+  }
+  int64_t bytes_allocated() const override { return used_; }
+  int64_t max_memory() const override { return peak_; }
+  int64_t total_bytes_allocated() const override { return total_; }
+  int64_t num_allocations() const override { return allocations_; }
+  string backend_name() const override { return base_->backend_name(); }
+
+private:
+  Status reserve(int64_t size) {
+    unique_lock<mutex> lock(mutex_);
+    while (limit_ && used_ + size > limit_) {
+      int64_t frees = frees_;
+      if (size > limit_ ||
+          !freed_.wait_for(lock, chrono::seconds(1),
+                           [&] { return frees_ != frees; })) {
+        return Status::OutOfMemory("max_memory of ", limit_,
+                                   " bytes exceeded allocating ", size,
+                                   " bytes with ", used_.load(), " in use");
+      }
+    }
+    used_ += size;
+    peak_ = max(peak_.load(), used_.load());
+    total_ += size;
+    ++allocations_;
+    if (used_ && !self_) self_ = shared_from_this();
+    return Status::OK();
+  }
+  void release(int64_t size) {
+    shared_ptr<WritePool> self; // dropped after the lock
+    lock_guard<mutex> lock(mutex_);
+    used_ -= size;
+    ++frees_;
+    freed_.notify_all();
+    if (!used_) self.swap(self_);
+  }
+  MemoryPool* base_;
+  int64_t limit_;
+  mutex mutex_;
+  condition_variable freed_;
+  shared_ptr<WritePool> self_; // set while bytes are allocated
+  atomic<int64_t> used_{0}, peak_{0}, total_{0}, allocations_{0};
+  int64_t frees_ = 0;
+};
+// Collected by write_parquet when the stats option is set. The pool tracks
+// the peak of this write's allocations alone.
+struct WriteStats {
+  explicit WriteStats(shared_ptr<WritePool> pool)
+      : memory_pool(move(pool)) {}
+  PhaseTime prepare, convert, encode, io;
+  PhaseTime fault; // waiting for pages of mapped columns
+  int64_t start_wall = clock_ns(CLOCK_MONOTONIC);
+  int64_t start_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  shared_ptr<WritePool> memory_pool;
+  mutex files_mutex;
+  vector<string> files;
+};
+// Adds the time until it goes out of scope to a phase, if stats are on. CPU
+// time is for the whole process unless a thread clock is given.
+class PhaseTimer {
+public:
+  PhaseTimer(WriteStats* stats, PhaseTime WriteStats::*phase,
+             clockid_t cpu_clock = CLOCK_PROCESS_CPUTIME_ID)
+      : phase_(stats ? &(stats->*phase) : nullptr), cpu_clock_(cpu_clock) {
+    if (!phase_) return;
+    wall_ = clock_ns(CLOCK_MONOTONIC);
+    cpu_ = clock_ns(cpu_clock_);
+  }
+  ~PhaseTimer() {
+    if (!phase_) return;
+    phase_->wall += clock_ns(CLOCK_MONOTONIC) - wall_;
+    phase_->cpu += clock_ns(cpu_clock_) - cpu_;
+  }
+
+private:
+  PhaseTime* phase_;
+  clockid_t cpu_clock_;
+  int64_t wall_ = 0, cpu_ = 0;
+};
+// List of char (or byte) vectors as a utf8 (binary) array with int32 offsets,
+// or large_utf8 (large_binary) with int64. The lengths are summed first, so
+// offsets and characters are written straight into buffers of their final
+// size.
+template <typename Offset>
+Status string_array(const K* items, int64_t length, signed char item_type,
+                    const char* not_strings, MemoryPool* pool,
+                    shared_ptr<Array>& array) {
+  int64_t chars = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    if (items[i]->t != item_type) return Status::Invalid(not_strings);
+    chars += items[i]->n;
+  }
+  if (chars > numeric_limits<Offset>::max()) {
+    return Status::CapacityError("String column of ", chars,
+                                 " bytes needs the large_strings option");
+  }
+  shared_ptr<Buffer> offsets, data;
+  ARROW_ASSIGN_OR_RAISE(offsets,
+                        AllocateBuffer((length + 1) * sizeof(Offset), pool));
+  ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(chars, pool));
+  Offset* out = offsets->mutable_data_as<Offset>();
+  uint8_t* dst = data->mutable_data();
+  out[0] = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    memcpy(dst + out[i], kG(items[i]), items[i]->n);
+    out[i + 1] = out[i] + Offset(items[i]->n);
+  }
+  bool large = sizeof(Offset) == sizeof(int64_t);
+  auto type = item_type == KC ? (large ? large_utf8() : utf8())
+                              : (large ? large_binary() : binary());
+  array = MakeArray(ArrayData::Make(type, length, {nullptr, offsets, data}));
+  return Status::OK();
+}
+// General list of numeric vectors of item_type as list<T>. Offsets come from
+// the item lengths, and the items are copied once into the child values,
+// whose nulls are found by the same kernels as for flat columns.
+template <typename T>
+Status list_array(const K* items, int64_t length, signed char item_type,
+                  const shared_ptr<DataType>& value_type,
+                  int64_t (*kernel)(const T*, int64_t, uint8_t*),
+                  MemoryPool* pool, shared_ptr<Array>& array) {
+  int64_t n_values = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    if (items[i]->t != item_type) {
+      return Status::Invalid(
+          "Unsupported general list structure (mixed item types)");
+    }
+    n_values += items[i]->n;
+  }
+  if (n_values > numeric_limits<int32_t>::max()) {
+    return Status::CapacityError("List column of ", n_values,
+                                 " values is too large");
+  }
+  shared_ptr<Buffer> offsets, bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(offsets,
+                        AllocateBuffer((length + 1) * sizeof(int32_t), pool));
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(n_values, pool));
+  ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(n_values * sizeof(T), pool));
+  int32_t* out = offsets->mutable_data_as<int32_t>();
+  T* values = data->mutable_data_as<T>();
+  out[0] = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    memcpy(values + out[i], kG(items[i]), items[i]->n * sizeof(T));
+    out[i + 1] = out[i] + int32_t(items[i]->n);
+  }
+  int64_t null_count = kernel(values, n_values, bitmap->mutable_data());
+  if (!null_count) bitmap.reset();
+  auto child = MakeArray(
+      ArrayData::Make(value_type, n_values, {bitmap, data}, null_count));
+  array = make_shared<ListArray>(arrow::list(value_type), length, offsets,
+                                 child);
+  return Status::OK();
+}
+// Bytes have no null
+int64_t no_nulls(const G*, int64_t, uint8_t*) {
+  return 0;
+}
+// GUID vector as fixed_size_binary(16), the null GUID (all zero) masked
+Status guid_array(K col, int64_t offset, int64_t length, bool zero_copy,
+                  MemoryPool* pool, shared_ptr<Array>& array) {
+  const U* values = kU(col) + offset;
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  uint8_t* bits = bitmap->mutable_data();
+  int64_t null_count = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    uint64_t halves[2];
+    memcpy(halves, values[i].g, sizeof(halves));
+    if (halves[0] | halves[1]) {
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    } else {
+      ++null_count;
+    }
+  }
+  if (!null_count) bitmap.reset();
+  if (zero_copy) {
+    data = make_shared<KBuffer>(col, values[0].g, length * sizeof(U));
+  } else {
+    ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(length * sizeof(U), pool));
+    memcpy(data->mutable_data(), values, length * sizeof(U));
+  }
+  array = MakeArray(ArrayData::Make(fixed_size_binary(sizeof(U)), length,
+                                    {bitmap, data}, null_count));
+  return Status::OK();
+}
+// Char vector as one-character strings, the offsets being the row numbers.
+// The blank char, q's null, is masked.
+template <typename Offset>
+Status char_array(K col, int64_t offset, int64_t length, bool zero_copy,
+                  MemoryPool* pool, shared_ptr<Array>& array) {
+  const char* chars = (const char*)kC(col) + offset;
+  shared_ptr<Buffer> offsets, bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(offsets,
+                        AllocateBuffer((length + 1) * sizeof(Offset), pool));
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  Offset* out = offsets->mutable_data_as<Offset>();
+  uint8_t* bits = bitmap->mutable_data();
+  int64_t null_count = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    out[i] = Offset(i);
+    if (chars[i] == ' ') {
+      ++null_count;
+    } else {
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    }
+  }
+  out[length] = Offset(length);
+  if (!null_count) bitmap.reset();
+  if (zero_copy) {
+    data = make_shared<KBuffer>(col, (const uint8_t*)chars, length);
+  } else {
+    ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(length, pool));
+    memcpy(data->mutable_data(), chars, length);
+  }
+  auto type = sizeof(Offset) == sizeof(int64_t) ? large_utf8() : utf8();
+  array = MakeArray(
+      ArrayData::Make(type, length, {bitmap, offsets, data}, null_count));
+  return Status::OK();
+}
+// Vector whose values need a conversion that is not a shift or a scale
+template <typename T, typename Out, typename Convert>
+Status converted_array(K col, int64_t offset, int64_t length,
+                       const shared_ptr<DataType>& type, Convert convert,
+                       MemoryPool* pool, shared_ptr<Array>& array) {
+  const T* values = reinterpret_cast<const T*>(kG(col)) + offset;
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  ARROW_ASSIGN_OR_RAISE(data, AllocateBuffer(length * sizeof(Out), pool));
+  uint8_t* bits = bitmap->mutable_data();
+  Out* out = data->mutable_data_as<Out>();
+  int64_t null_count = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    if (convert(values[i], out[i])) {
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    } else {
+      out[i] = 0;
+      ++null_count;
+    }
+  }
+  if (!null_count) bitmap.reset();
+  array = MakeArray(ArrayData::Make(type, length, {bitmap, data}, null_count));
+  return Status::OK();
+}
+// Months since 2000.01 to days since 1970.01.01 of the month's first day
+bool month_to_date(I month, int32_t& days) {
+  if (month == ni) return false;
+  int64_t m = int64_t(month) + 2000 * 12 - 2; // months since 0000.03
+  int64_t y = (m >= 0 ? m : m - 11) / 12;
+  int64_t mp = m - y * 12; // month from March, 0-11
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + (153 * mp + 2) / 5;
+  days = int32_t(era * 146097 + doe - 719468);
+  return true;
+}
+// Days since 2000.01.01 as a float to milliseconds since 1970
+bool datetime_to_ms(F datetime, int64_t& ms) {
+  if (isnan(datetime) || isinf(datetime)) return false;
+  ms = llround((datetime + 10957) * 86400000.0);
+  return true;
+}
+// Sym domain of an enumeration as an Arrow dictionary. Null symbols stay in
+// the dictionary and are masked through the indices' validity bitmap.
+struct EnumDomain {
+  shared_ptr<Array> dictionary;
+  vector<bool> is_null;
+};
+// Look-ahead over the vectors of a table mapped from disk, e.g. a splayed
+// table or HDB partition loaded with get. Each column slice is faulted in
+// just before it is converted, while the slices within the next window bytes
+// are madvised WILLNEED, so that the disk reads ahead of the conversion
+// instead of taking turns with it.
+class Prefetcher {
+public:
+  // slice_rows is the length of the slices kdb_to_arrow is called on
+  Prefetcher(K table, int64_t slice_rows, int64_t window);
+  // Called before rows [offset, offset + slice_rows) of column c convert
+  void reach(size_t c, int64_t offset, WriteStats* stats);
+
+private:
+  struct Range {
+    const char* data;
+    int64_t bytes; // 0 for columns that are not simple lists
+  };
+  vector<Range> ranges_; // in conversion order: by slice, then column
+  size_t n_cols_;
+  int64_t slice_rows_, window_;
+  mutex mutex_;
+  size_t advised_ = 0; // ranges before it have been advised
+};
+// State shared by all slices of one table. Anything that calls back into q is
+// resolved up front by prepare_convert, on the q thread.
+struct ConvertContext {
+  ConvertOptions opts;
+  unordered_map<K, EnumDomain> domains; // keyed by domain sym list
+  vector<EnumDomain*> col_domains;      // per column, null if not an enum
+  vector<bool> sym_dicts; // per column, symbols converted to a dictionary
+  // keeps sym_dicts across tables written to one file or dataset
+  bool fixed_sym_dicts = false;
+  vector<shared_ptr<Array>> q_arrays;   // columns converted up front
+  K syms = nullptr; // an HDB's sym file, the domain of columns enumerated
+                    // against `sym; other domains are looked up in q
+  shared_ptr<internal::ThreadPool> own_pool;
+  internal::Executor* pool = nullptr; // null converts columns serially
+  MemoryPool* memory_pool = default_memory_pool();
+  WriteStats* stats = nullptr; // set by write_parquet's stats option
+  // Keys the rows are sorted by, column_idx indexing the kdb table
+  vector<parquet::SortingColumn> sort_keys;
+  shared_ptr<Prefetcher> prefetcher; // set by the prefetch option
+  vector<int64_t> order; // rows in sort_by order, empty for table order
+};
+Status make_domain(K syms, EnumDomain& entry) {
+  StringBuilder builder;
+  ARROW_RETURN_NOT_OK(builder.Reserve(syms->n));
+  entry.is_null.resize(syms->n);
+  for (J i = 0; i < syms->n; ++i) {
+    entry.is_null[i] = is_null(kS(syms)[i]);
+    ARROW_RETURN_NOT_OK(builder.Append(kS(syms)[i]));
+  }
+  return builder.Finish(&entry.dictionary);
+}
+Status enum_domain(K col, ConvertContext& ctx, EnumDomain*& domain) {
+  string domain_name;
+  if (ctx.syms) {
+    K name = k(0, (S) "{key x}", r1(col), (K)0);
+    if (name && name->t == -KS) domain_name = name->s;
+    if (name) r0(name);
+  }
+  K syms = ctx.syms && domain_name == "sym"
+               ? r1(ctx.syms)
+               : k(0, (S) "{value key x}", r1(col), (K)0); // no copy
+  if (!syms || syms->t != KS) {
+    if (syms) r0(syms);
+    return Status::Invalid("Failed to resolve enum domain" +
+                           (domain_name.empty() ? "" : " " + domain_name));
+  }
+  auto it = ctx.domains.find(syms);
+  if (it == ctx.domains.end()) {
+    EnumDomain& entry = ctx.domains[syms];
+    Status st = make_domain(syms, entry);
+    if (!st.ok()) {
+      r0(syms);
+      return st;
+    }
+    domain = &entry;
+  } else {
+    domain = &it->second;
+  }
+  r0(syms);
+  return Status::OK();
+}
+// Plain symbol vector as dictionary<int32, utf8>. Symbols are interned, so
+// the dictionary is keyed on the pointer: each distinct symbol is copied once
+// and every row is a pointer lookup, with no string hashing.
+Status symbol_array(K col, int64_t offset, int64_t length, MemoryPool* pool,
+                    shared_ptr<Array>& array) {
+  const S* values = kS(col) + offset;
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  ARROW_ASSIGN_OR_RAISE(data,
+                        AllocateBuffer(length * sizeof(int32_t), pool));
+  uint8_t* bits = bitmap->mutable_data();
+  int32_t* out = data->mutable_data_as<int32_t>();
+  unordered_map<S, int32_t> index; // -1 for the null symbol
+  StringBuilder dict(pool);
+  S last = nullptr;
+  int32_t last_index = -1;
+  int64_t null_count = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    S value = values[i];
+    if (value != last) { // sorted columns repeat the previous symbol
+      auto [it, added] = index.try_emplace(value, -1);
+      if (added && !is_null(value)) {
+        it->second = dict.length();
+        ARROW_RETURN_NOT_OK(dict.Append(value));
+      }
+      last = value;
+      last_index = it->second;
+    }
+    if (last_index < 0) {
+      out[i] = 0;
+      ++null_count;
+    } else {
+      out[i] = last_index;
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    }
+  }
+  shared_ptr<Array> symbols;
+  ARROW_RETURN_NOT_OK(dict.Finish(&symbols));
+  if (!null_count) bitmap.reset();
+  auto indices = MakeArray(
+      ArrayData::Make(int32(), length, {bitmap, data}, null_count));
+  array = make_shared<DictionaryArray>(dictionary(int32(), utf8()), indices,
+                                       symbols);
+  return Status::OK();
+}
+// Whether a vector repeats enough for a dictionary to pay off, judged from
+// its first rows
+template <typename T> bool few_distinct(const T* values, int64_t n) {
+  int64_t sample = min<int64_t>(n, 1 << 16);
+  unordered_set<T> distinct;
+  for (int64_t i = 0; i < sample; ++i) {
+    distinct.insert(values[i]);
+    if (2 * int64_t(distinct.size()) > sample) return false;
+  }
+  return true;
+}
+// Decided once per file or dataset so every slice of a symbol column has the
+// same type
+bool low_cardinality(K col) { return few_distinct(kS(col), col->n); }
+int64_t table_rows(K table) {
+  K col_vectors = kK(table->k)[1];
+  return col_vectors->n ? kK(col_vectors)[0]->n : 0;
+}
+// Three-way comparisons in kdb order, nulls first. Float nulls are NaN.
+template <typename T> int compare(T a, T b) { return (b < a) - (a < b); }
+template <typename T> int compare_float(T a, T b) {
+  bool a_null = isnan(a), b_null = isnan(b);
+  return a_null || b_null ? b_null - a_null : compare(a, b);
+}
+int compare_symbol(S a, S b) {
+  return a == b ? 0 : compare(strcmp(a, b), 0);
+}
+// Direction a column is sorted in within each run of rows equal on the keys
+// so far, starts marking where runs begin: 1 ascending, -1 descending, 0 if
+// neither. On success starts also marks where the column changes.
+template <typename Compare>
+int sorted_within(J n, vector<bool>& starts, Compare cmp) {
+  vector<bool> next = starts;
+  bool up = true, down = true;
+  for (J i = 1; i < n && (up || down); ++i) {
+    int c = cmp(i - 1, i);
+    if (c) next[i] = true;
+    if (starts[i]) continue;
+    up &= c <= 0;
+    down &= c >= 0;
+  }
+  if (!up && !down) return 0;
+  starts.swap(next);
+  return up ? 1 : -1;
+}
+int sorted_within(K col, const EnumDomain* domain, vector<bool>& starts) {
+  J n = col->n;
+  if (domain) {
+    auto& syms = static_cast<const StringArray&>(*domain->dictionary);
+    J n_syms = syms.length();
+    auto sym = [&](J i) {
+      J value = kJ(col)[i];
+      return value < 0 || value >= n_syms ? string_view() : syms.GetView(value);
+    };
+    return sorted_within(n, starts, [&](J a, J b) {
+      return compare(sym(a).compare(sym(b)), 0);
+    });
+  }
+  switch (col->t) {
+    case KB:
+    case KG:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare(kG(col)[a], kG(col)[b]);
+      });
+    case KH:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare(kH(col)[a], kH(col)[b]);
+      });
+    case KI:
+    case KM:
+    case KD:
+    case KU:
+    case KV:
+    case KT:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare(kI(col)[a], kI(col)[b]);
+      });
+    case KJ:
+    case KP:
+    case KN:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare(kJ(col)[a], kJ(col)[b]);
+      });
+    case KE:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare_float(kE(col)[a], kE(col)[b]);
+      });
+    case KF:
+    case KZ:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare_float(kF(col)[a], kF(col)[b]);
+      });
+    case KS:
+      return sorted_within(n, starts, [&](J a, J b) {
+        return compare_symbol(kS(col)[a], kS(col)[b]);
+      });
+    default: // chars, guids and nested columns are not checked
+      return 0;
+  }
+}
+// Keys for the sorting_columns metadata. By default only s# columns, which
+// need no check. With sort_check, columns are tried in turn, s# and p# first,
+// each becoming the next key if sorted within the runs of the keys before.
+// Declared keys are checked the same way.
+Status find_sort_keys(K table, const ConvertOptions& conv_opts,
+                      ConvertContext& ctx) {
   K col_names = kK(table->k)[0];
   K col_vectors = kK(table->k)[1];
-  int n_rows = kK(col_vectors)[0]->n;
-  vector<shared_ptr<Field>> fields;
-  vector<shared_ptr<Array>> arrays;
-  for (size_t c = 0; c < col_names->n; ++c) {
-    string col_name = kS(col_names)[c];
-    K col = kK(col_vectors)[c];
-    bool is_enum = (col->t >= 20 && col->t <= 76);
-    if (is_enum) {
-      col = k(0, (S) "value", r1(col), (K)0); // de-enumerate enum list
-      if (!col) return Status::Invalid("Failed to de-enumerate list");
+  J n = table_rows(table);
+  ctx.sort_keys.clear();
+  auto add_key = [&](J c, int order) {
+    ctx.sort_keys.push_back({int32_t(c), order < 0, order > 0});
+  };
+  if (!conv_opts.sort_check && conv_opts.sorting_columns.empty()) {
+    for (J c = 0; c < col_vectors->n; ++c) {
+      if (kK(col_vectors)[c]->u == 1) add_key(c, 1);
     }
-    switch (col->t) {
-      case 0: { // mixed (could be string)
-        for (size_t i = 0; i < n_rows; ++i) {
-          if (kK(col)[i]->t != KC) {
-            return Status::Invalid(
-                "Unsupported general list structure (not string list)");
-          }
-        }
-        StringBuilder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          K str_k = kK(col)[i];
-          string s((S)kC(str_k), str_k->n);
-          ARROW_RETURN_NOT_OK(builder.Append(s));
-        }
-        APPEND_ARRAY(builder, utf8());
+    return Status::OK();
+  }
+  vector<bool> starts(n);
+  if (n) starts[0] = true;
+  auto all_starts = [&] {
+    return find(starts.begin(), starts.end(), false) == starts.end();
+  };
+  for (const string& name : conv_opts.sorting_columns) {
+    J c = 0;
+    while (c < col_names->n && name != kS(col_names)[c]) ++c;
+    if (c == col_names->n) return Status::Invalid("no column " + name);
+    int order =
+        sorted_within(kK(col_vectors)[c], ctx.col_domains[c], starts);
+    if (!order) return Status::Invalid("rows are not sorted by " + name);
+    add_key(c, order);
+  }
+  if (!conv_opts.sort_check) return Status::OK();
+  vector<J> candidates;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (J c = 0; c < col_vectors->n; ++c) {
+      char u = kK(col_vectors)[c]->u;
+      if ((u == 1 || u == 3) == !pass) candidates.push_back(c);
+    }
+  }
+  bool found = true;
+  while (found && !all_starts()) {
+    found = false;
+    for (J c : candidates) {
+      bool used = false;
+      for (auto& key : ctx.sort_keys) used |= key.column_idx == c;
+      if (used) continue;
+      int order = sorted_within(kK(col_vectors)[c], ctx.col_domains[c], starts);
+      if (order) {
+        add_key(c, order);
+        found = true;
         break;
       }
-      case 77: { // anymap (could be string)
-        for (size_t i = 0; i < n_rows; ++i) {
-          K item = vi(col, i);
-          if (item->t != KC) {
-            r0(item);
-            return Status::Invalid(
-                "Unsupported anymap structure (not string list)");
+    }
+  }
+  return Status::OK();
+}
+int elem_size(signed char t);
+// Floats as unsigned keys in q's order: nulls (NaN) first, -0 equal to 0
+uint64_t float_key(double value) {
+  if (isnan(value)) return 0;
+  if (value == 0) value = 0;
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits >> 63 ? ~bits : bits | (uint64_t(1) << 63);
+}
+// Column values as unsigned keys that sort in q's ascending order, nulls
+// first. Symbols and enumerations are keyed by the rank of their strings.
+Status sort_keys(K col, const EnumDomain* domain, const string& name,
+                 vector<uint64_t>& keys) {
+  J n = col->n;
+  keys.resize(n);
+  if (domain) {
+    auto& dict = static_cast<const StringArray&>(*domain->dictionary);
+    vector<int64_t> by_string(dict.length());
+    iota(by_string.begin(), by_string.end(), 0);
+    stable_sort(by_string.begin(), by_string.end(), [&](int64_t a, int64_t b) {
+      return dict.GetView(a) < dict.GetView(b);
+    });
+    vector<uint64_t> rank(dict.length());
+    for (size_t r = 0; r < by_string.size(); ++r) rank[by_string[r]] = r + 1;
+    for (J i = 0; i < n; ++i) {
+      J value = kJ(col)[i];
+      bool valid = value >= 0 && value < dict.length() &&
+                   !domain->is_null[value];
+      keys[i] = valid ? rank[value] : 0;
+    }
+    return Status::OK();
+  }
+  switch (col->t) {
+    case KB:
+    case KG:
+    case KC:
+      for (J i = 0; i < n; ++i) keys[i] = kG(col)[i];
+      break;
+    case KH:
+      for (J i = 0; i < n; ++i) keys[i] = uint16_t(kH(col)[i]) ^ 0x8000u;
+      break;
+    case KI:
+    case KM:
+    case KD:
+    case KU:
+    case KV:
+    case KT:
+      for (J i = 0; i < n; ++i) keys[i] = uint32_t(kI(col)[i]) ^ 0x80000000u;
+      break;
+    case KJ:
+    case KP:
+    case KN:
+      for (J i = 0; i < n; ++i) {
+        keys[i] = uint64_t(kJ(col)[i]) ^ (uint64_t(1) << 63);
+      }
+      break;
+    case KE:
+      for (J i = 0; i < n; ++i) keys[i] = float_key(kE(col)[i]);
+      break;
+    case KF:
+    case KZ:
+      for (J i = 0; i < n; ++i) keys[i] = float_key(kF(col)[i]);
+      break;
+    case KS: { // interned, so each distinct symbol is ranked once
+      unordered_map<S, uint64_t> ranks;
+      for (J i = 0; i < n; ++i) ranks.emplace(kS(col)[i], 0);
+      vector<S> syms;
+      for (auto& entry : ranks) syms.push_back(entry.first);
+      sort(syms.begin(), syms.end(),
+           [](S a, S b) { return strcmp(a, b) < 0; });
+      for (size_t r = 0; r < syms.size(); ++r) ranks[syms[r]] = r;
+      for (J i = 0; i < n; ++i) keys[i] = ranks[kS(col)[i]];
+      break;
+    }
+    default:
+      return Status::Invalid("sort_by does not support column " + name);
+  }
+  return Status::OK();
+}
+// Stable LSD radix sort of order by keys[order[i]], 11 bits per pass,
+// skipping the passes in which every key has the same digit. Blocks of rows
+// are counted and scattered in parallel, each block into its own slots for
+// each digit, so rows with equal keys keep their order.
+Status radix_sort(const vector<uint64_t>& keys, vector<int64_t>& order,
+                  internal::Executor* pool) {
+  constexpr int bits = 11, buckets = 1 << bits;
+  int64_t n = order.size();
+  vector<uint64_t> sorted(n), sorted_tmp(n);
+  vector<int64_t> order_tmp(n);
+  uint64_t any = 0, all = ~uint64_t(0);
+  for (int64_t i = 0; i < n; ++i) {
+    sorted[i] = keys[order[i]];
+    any |= sorted[i];
+    all &= sorted[i];
+  }
+  int n_blocks = 1;
+  if (pool) {
+    n_blocks = int(max<int64_t>(
+        1, min<int64_t>(pool->GetCapacity(), n / (16 * buckets))));
+  }
+  int64_t block = (n + n_blocks - 1) / n_blocks;
+  vector<int64_t> counts(int64_t(n_blocks) * buckets);
+  for (int shift = 0; shift < 64; shift += bits) {
+    if (!(((any ^ all) >> shift) & (buckets - 1))) continue;
+    fill(counts.begin(), counts.end(), 0);
+    ARROW_RETURN_NOT_OK(internal::OptionalParallelFor(
+        n_blocks > 1, n_blocks,
+        [&](int b) {
+          int64_t* count = &counts[int64_t(b) * buckets];
+          for (int64_t i = b * block; i < min(n, (b + 1) * block); ++i) {
+            ++count[(sorted[i] >> shift) & (buckets - 1)];
           }
-          r0(item);
-        }
-        StringBuilder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          K item = vi(col, i);
-          string s((S)kC(item), item->n);
-          r0(item);
-          ARROW_RETURN_NOT_OK(builder.Append(s));
-        }
-        APPEND_ARRAY(builder, utf8());
-        break;
+          return Status::OK();
+        },
+        pool));
+    int64_t total = 0;
+    for (int d = 0; d < buckets; ++d) {
+      for (int b = 0; b < n_blocks; ++b) {
+        int64_t& slot = counts[int64_t(b) * buckets + d];
+        int64_t count = slot;
+        slot = total;
+        total += count;
       }
-      case KB: { // boolean
-        BooleanBuilder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          ARROW_RETURN_NOT_OK(builder.Append(bool(kG(col)[i])));
-        }
-        APPEND_ARRAY(builder, boolean());
-        break;
+    }
+    ARROW_RETURN_NOT_OK(internal::OptionalParallelFor(
+        n_blocks > 1, n_blocks,
+        [&](int b) {
+          int64_t* next = &counts[int64_t(b) * buckets];
+          for (int64_t i = b * block; i < min(n, (b + 1) * block); ++i) {
+            int64_t j = next[(sorted[i] >> shift) & (buckets - 1)]++;
+            sorted_tmp[j] = sorted[i];
+            order_tmp[j] = order[i];
+          }
+          return Status::OK();
+        },
+        pool));
+    sorted.swap(sorted_tmp);
+    order.swap(order_tmp);
+  }
+  return Status::OK();
+}
+// Row order of the sort_by option, sorting by the last key first so that
+// each stable pass keeps the order of the keys after it. The keys become
+// the file's sorting_columns.
+Status sort_rows(K table, const vector<string>& names, ConvertContext& ctx) {
+  K col_names = kK(table->k)[0];
+  K col_vectors = kK(table->k)[1];
+  vector<J> cols;
+  for (const string& name : names) {
+    J c = 0;
+    while (c < col_names->n && name != kS(col_names)[c]) ++c;
+    if (c == col_names->n) return Status::Invalid("no column " + name);
+    cols.push_back(c);
+  }
+  for (J c = 0; c < col_vectors->n; ++c) {
+    if (kK(col_vectors)[c]->t == 77) {
+      return Status::Invalid("sort_by does not support anymap columns");
+    }
+  }
+  ctx.order.resize(table_rows(table));
+  iota(ctx.order.begin(), ctx.order.end(), 0);
+  vector<uint64_t> keys;
+  for (auto c = cols.rbegin(); c != cols.rend(); ++c) {
+    ARROW_RETURN_NOT_OK(sort_keys(kK(col_vectors)[*c], ctx.col_domains[*c],
+                                  kS(col_names)[*c], keys));
+    ARROW_RETURN_NOT_OK(radix_sort(keys, ctx.order, ctx.pool));
+  }
+  ctx.sort_keys.clear();
+  for (J c : cols) ctx.sort_keys.push_back({int32_t(c), false, true});
+  return Status::OK();
+}
+// Page-aligned madvise over [data, data + bytes)
+void advise(const char* data, int64_t bytes, int advice) {
+  static const uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = uintptr_t(data) & ~(page - 1);
+  madvise((void*)start, uintptr_t(data) + bytes - start, advice);
+}
+Prefetcher::Prefetcher(K table, int64_t slice_rows, int64_t window)
+    : n_cols_(kK(table->k)[1]->n), slice_rows_(max<int64_t>(1, slice_rows)),
+      window_(window) {
+  K col_vectors = kK(table->k)[1];
+  int64_t n_rows = table_rows(table);
+  for (size_t c = 0; c < n_cols_; ++c) {
+    K col = kK(col_vectors)[c];
+    int size = elem_size(col->t);
+    if (size && col->n) advise((char*)kG(col), col->n * size, MADV_SEQUENTIAL);
+  }
+  for (int64_t offset = 0; offset < n_rows; offset += slice_rows_) {
+    int64_t length = min(slice_rows_, n_rows - offset);
+    for (size_t c = 0; c < n_cols_; ++c) {
+      K col = kK(col_vectors)[c];
+      int size = elem_size(col->t);
+      ranges_.push_back({(char*)kG(col) + offset * size, length * size});
+    }
+  }
+}
+void Prefetcher::reach(size_t c, int64_t offset, WriteStats* stats) {
+  size_t i = offset / slice_rows_ * n_cols_ + c;
+  if (i >= ranges_.size() || !ranges_[i].bytes) return;
+  {
+    lock_guard<mutex> lock(mutex_);
+    int64_t ahead = 0;
+    for (size_t j = i; j < ranges_.size() && ahead < window_; ++j) {
+      ahead += ranges_[j].bytes;
+      if (j < advised_ || !ranges_[j].bytes) continue;
+      advise(ranges_[j].data, ranges_[j].bytes, MADV_WILLNEED);
+      advised_ = j + 1;
+    }
+  }
+  // Touch a byte per page, so that the time blocked on reads shows up as the
+  // fault phase rather than inside the conversion
+  static const int64_t page = sysconf(_SC_PAGESIZE);
+  PhaseTimer timer(stats, &WriteStats::fault, CLOCK_THREAD_CPUTIME_ID);
+  const volatile char* data = ranges_[i].data;
+  char sum = 0;
+  for (int64_t b = 0; b < ranges_[i].bytes; b += page) sum += data[b];
+  (void)sum;
+}
+Status prepare_convert(K table, const ConvertOptions& conv_opts,
+                       ConvertContext& ctx) {
+  K col_vectors = kK(table->k)[1];
+  ctx.opts = conv_opts;
+  ctx.col_domains.assign(col_vectors->n, nullptr);
+  bool keep_dicts =
+      ctx.fixed_sym_dicts && ctx.sym_dicts.size() == col_vectors->n;
+  if (!keep_dicts) ctx.sym_dicts.assign(col_vectors->n, false);
+  // A writer session keeps its thread pool across batches
+  if (!ctx.pool && conv_opts.conversion_threads == 0) {
+    ctx.pool = internal::GetCpuThreadPool();
+  } else if (!ctx.pool && conv_opts.conversion_threads > 1) {
+    ARROW_ASSIGN_OR_RAISE(
+        ctx.own_pool, internal::ThreadPool::Make(conv_opts.conversion_threads));
+    ctx.pool = ctx.own_pool.get();
+  }
+  for (size_t c = 0; c < col_vectors->n; ++c) {
+    K col = kK(col_vectors)[c];
+    if (col->t >= 20 && col->t <= 76) {
+      ARROW_RETURN_NOT_OK(enum_domain(col, ctx, ctx.col_domains[c]));
+    }
+    if (col->t == KS && !keep_dicts) ctx.sym_dicts[c] = low_cardinality(col);
+  }
+  ctx.prefetcher.reset();
+  ctx.order.clear();
+  if (!conv_opts.sort_by.empty()) {
+    if (conv_opts.sort_check || !conv_opts.sorting_columns.empty()) {
+      return Status::Invalid("sort_by and sorting_columns cannot be combined");
+    }
+    // gathered rows jump around the columns, so there is no order to read
+    // ahead in
+    if (conv_opts.prefetch) {
+      return Status::Invalid("sort_by and prefetch cannot be combined");
+    }
+    ctx.opts.zero_copy = false; // rows are gathered rather than wrapped
+    return sort_rows(table, conv_opts.sort_by, ctx);
+  }
+  if (conv_opts.prefetch) {
+    int64_t slice_rows =
+        conv_opts.streaming ? conv_opts.chunk_size : table_rows(table);
+    ctx.prefetcher =
+        make_shared<Prefetcher>(table, slice_rows, conv_opts.prefetch);
+  }
+  return find_sort_keys(table, conv_opts, ctx);
+}
+// Enumerated symbol vector as dictionary<int32, utf8>, without de-enumerating
+// it in q. kdb+ 3.x stores enum indices as longs, narrowed here to int32.
+Status enum_array(K col, int64_t offset, int64_t length,
+                  const EnumDomain& domain, MemoryPool* pool,
+                  shared_ptr<Array>& array) {
+  const J* values = kJ(col) + offset;
+  int64_t n_syms = domain.is_null.size();
+  shared_ptr<Buffer> bitmap, data;
+  ARROW_ASSIGN_OR_RAISE(bitmap, AllocateEmptyBitmap(length, pool));
+  ARROW_ASSIGN_OR_RAISE(data,
+                        AllocateBuffer(length * sizeof(int32_t), pool));
+  uint8_t* bits = bitmap->mutable_data();
+  int32_t* out = data->mutable_data_as<int32_t>();
+  int64_t null_count = 0;
+  for (int64_t i = 0; i < length; ++i) {
+    J value = values[i];
+    if (value < 0 || value >= n_syms || domain.is_null[value]) {
+      out[i] = 0;
+      ++null_count;
+    } else {
+      out[i] = int32_t(value);
+      bits[i >> 3] |= uint8_t(1) << (i & 7);
+    }
+  }
+  if (!null_count) bitmap.reset();
+  auto indices = MakeArray(
+      ArrayData::Make(int32(), length, {bitmap, data}, null_count));
+  array = make_shared<DictionaryArray>(dictionary(int32(), utf8()), indices,
+                                       domain.dictionary);
+  return Status::OK();
+}
+Status set_convert_options(K& opts, ConvertOptions& conv_opts) {
+  K keys = kK(opts)[0];
+  K vals = kK(opts)[1];
+  for (size_t i = 0; i < keys->n; ++i) {
+    string opt(kS(keys)[i]);
+    if (opt == "zero_copy" && !opt_bool(vals, i, conv_opts.zero_copy)) {
+      return Status::Invalid("zero_copy must be a boolean");
+    }
+    if (opt == "streaming" && !opt_bool(vals, i, conv_opts.streaming)) {
+      return Status::Invalid("streaming must be a boolean");
+    }
+    if (opt == "stats" && !opt_bool(vals, i, conv_opts.stats)) {
+      return Status::Invalid("stats must be a boolean");
+    }
+    if (opt == "large_strings" &&
+        !opt_bool(vals, i, conv_opts.large_strings)) {
+      return Status::Invalid("large_strings must be a boolean");
+    }
+    if (opt == "memory_pool") {
+      string name;
+      if (!opt_symbol(vals, i, name)) {
+        return Status::Invalid("memory_pool must be a symbol");
       }
-      case KH: { // short
-        Int16Builder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kH(col)[i], nh);
-        }
-        APPEND_ARRAY(builder, int16());
-        break;
+      ARROW_RETURN_NOT_OK(named_pool(name, conv_opts.memory_pool));
+    }
+    if (opt == "max_memory") {
+      J max_memory;
+      if (!opt_long(vals, i, max_memory) || max_memory < 0) {
+        return Status::Invalid("max_memory must be a long >= 0");
       }
-      case KI: { // int
-        Int32Builder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kI(col)[i], ni);
-        }
-        APPEND_ARRAY(builder, int32());
-        break;
+      conv_opts.max_memory = max_memory;
+    }
+    if (opt == "chunk_size") {
+      J chunk_size;
+      if (!opt_long(vals, i, chunk_size) || chunk_size <= 0) {
+        return Status::Invalid("chunk_size must be a positive long");
       }
-      case KJ: { // long
-        Int64Builder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kJ(col)[i], nj);
-        }
-        APPEND_ARRAY(builder, int64());
-        break;
+      conv_opts.chunk_size = chunk_size;
+    }
+    if (opt == "sorting_columns") {
+      vector<string>& names = conv_opts.sorting_columns;
+      if (!opt_symbols(vals, i, names)) {
+        return Status::Invalid(
+            "sorting_columns must be `auto or a symbol list of columns");
       }
-      case KE: { // real
-        FloatBuilder builder;
-        E value;
-        for (size_t i = 0; i < n_rows; ++i) {
-          value = kE(col)[i];
-          if (isnan(value)) {
-            ARROW_RETURN_NOT_OK(builder.AppendNull());
-          } else {
-            ARROW_RETURN_NOT_OK(builder.Append(value));
-          }
-        }
-        APPEND_ARRAY(builder, float32());
-        break;
+      if (names == vector<string>{"auto"}) {
+        conv_opts.sort_check = true;
+        names.clear();
       }
-      case KF: { // float
-        DoubleBuilder builder;
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kF(col)[i], nf);
-        }
-        APPEND_ARRAY(builder, float64());
-        break;
+    }
+    OutputOptions& output = conv_opts.output;
+    if (opt == "write_buffer") {
+      J bytes;
+      if (!opt_long(vals, i, bytes) || bytes < 0) {
+        return Status::Invalid("write_buffer must be a long >= 0");
       }
-      case KD: { // date
-        Date32Builder builder;
-        I value;
-        constexpr int kdb_epoch_offset = 10957;
-        for (size_t i = 0; i < n_rows; ++i) {
-          value = kI(col)[i];
-          if (value == ni) {
-            ARROW_RETURN_NOT_OK(builder.AppendNull());
-          } else {
-            ARROW_RETURN_NOT_OK(builder.Append(value + kdb_epoch_offset));
-          }
-        }
-        APPEND_ARRAY(builder, date32());
-        break;
+      output.write_buffer = bytes;
+    }
+    if (opt == "direct_io" && !opt_bool(vals, i, output.direct_io)) {
+      return Status::Invalid("direct_io must be a boolean");
+    }
+    if (opt == "atomic" && !opt_bool(vals, i, output.atomic)) {
+      return Status::Invalid("atomic must be a boolean");
+    }
+    if (opt == "fsync") {
+      string sync;
+      opt_symbol(vals, i, sync);
+      if (sync == "none")
+        output.fsync = OutputOptions::Sync::none;
+      else if (sync == "file")
+        output.fsync = OutputOptions::Sync::file;
+      else if (sync == "all")
+        output.fsync = OutputOptions::Sync::all;
+      else
+        return Status::Invalid("fsync must be `none, `file or `all");
+    }
+    if (opt == "sort_by" && !opt_symbols(vals, i, conv_opts.sort_by)) {
+      return Status::Invalid("sort_by must be a symbol or symbol list");
+    }
+    if (opt == "prefetch") {
+      bool on;
+      J bytes;
+      if (opt_bool(vals, i, on)) {
+        conv_opts.prefetch = on ? 64LL << 20 : 0;
+      } else if (opt_long(vals, i, bytes) && bytes >= 0) {
+        conv_opts.prefetch = bytes;
+      } else {
+        return Status::Invalid("prefetch must be a boolean or a long >= 0");
       }
-      case KS: { // symbol
-        StringBuilder builder;
-        S value;
-        for (size_t i = 0; i < n_rows; ++i) {
-          value = kS(col)[i];
-          if (is_null(value)) {
-            ARROW_RETURN_NOT_OK(builder.AppendNull());
-          } else {
-            ARROW_RETURN_NOT_OK(builder.Append(value));
-          }
-        }
-        APPEND_ARRAY(builder, utf8());
-        break;
+    }
+    if (opt == "conversion_threads") {
+      J threads;
+      if (!opt_long(vals, i, threads) || threads < 0) {
+        return Status::Invalid("conversion_threads must be a long >= 0");
       }
-      case KP: { // timestamp
-        TimestampBuilder builder(timestamp(TimeUnit::NANO),
-                                 default_memory_pool());
-        constexpr long long kdb_epoch_offset = 946684800000000000LL;
-        J value;
-        for (size_t i = 0; i < n_rows; ++i) {
-          value = kJ(col)[i];
-          if (value == nj) {
-            ARROW_RETURN_NOT_OK(builder.AppendNull());
-          } else {
-            ARROW_RETURN_NOT_OK(builder.Append(value + kdb_epoch_offset));
-          }
-        }
-        APPEND_ARRAY(builder, timestamp(TimeUnit::NANO));
+      conv_opts.conversion_threads = threads;
+    }
+  }
+  return Status::OK();
+}
+template <typename T>
+void gather(const void* values, const int64_t* rows, int64_t length,
+            void* out) {
+  for (int64_t i = 0; i < length; ++i) {
+    static_cast<T*>(out)[i] = static_cast<const T*>(values)[rows[i]];
+  }
+}
+// Rows of a column in sort_by order, gathered into a buffer laid out like a
+// kdb vector so that the converters read it as they would read the column
+Status gather_rows(K col, const int64_t* rows, int64_t length,
+                   MemoryPool* pool, shared_ptr<Buffer>& out) {
+  int size = col->t == 0 ? sizeof(K) : elem_size(col->t);
+  int64_t header = kG(col) - reinterpret_cast<G*>(col);
+  ARROW_ASSIGN_OR_RAISE(out, AllocateBuffer(header + length * size, pool));
+  K k = reinterpret_cast<K>(out->mutable_data());
+  memcpy(k, col, header);
+  k->u = 0;
+  k->n = length;
+  switch (size) {
+    case 1:
+      gather<uint8_t>(kG(col), rows, length, kG(k));
+      break;
+    case 2:
+      gather<uint16_t>(kG(col), rows, length, kG(k));
+      break;
+    case 4:
+      gather<uint32_t>(kG(col), rows, length, kG(k));
+      break;
+    case 8:
+      gather<uint64_t>(kG(col), rows, length, kG(k));
+      break;
+    case 16:
+      gather<U>(kG(col), rows, length, kG(k));
+      break;
+    default:
+      return Status::Invalid("sort_by does not support column type ",
+                             int(col->t));
+  }
+  return Status::OK();
+}
+// Converts rows [offset, offset + length) of column c, in sort_by order if
+// set. Safe to run off the q thread for every column type except anymaps,
+// which go through vi.
+Status convert_column(K table, size_t c, const ConvertContext& ctx,
+                      int64_t offset, int64_t length,
+                      vector<shared_ptr<Field>>& fields,
+                      vector<shared_ptr<Array>>& arrays) {
+  K col_names = kK(table->k)[0];
+  K col_vectors = kK(table->k)[1];
+  string col_name = kS(col_names)[c];
+  K col = kK(col_vectors)[c];
+  shared_ptr<Buffer> sorted; // freed once the slice is converted
+  if (!ctx.order.empty()) {
+    ARROW_RETURN_NOT_OK(gather_rows(col, ctx.order.data() + offset, length,
+                                    ctx.memory_pool, sorted));
+    col = reinterpret_cast<K>(sorted->mutable_data());
+    offset = 0;
+  }
+  int64_t end = offset + length;
+  if (!ctx.q_arrays.empty() && ctx.q_arrays[c]) {
+    arrays[c] = ctx.q_arrays[c]->Slice(offset, length);
+    fields[c] = field(col_name, arrays[c]->type());
+    return Status::OK();
+  }
+  if (ctx.col_domains[c]) { // enumerated symbol
+    shared_ptr<Array> array;
+    ARROW_RETURN_NOT_OK(enum_array(col, offset, length, *ctx.col_domains[c],
+                                   ctx.memory_pool, array));
+    arrays[c] = array;
+    fields[c] = field(col_name, array->type());
+    return Status::OK();
+  }
+  auto append_strings = [&](const K* items, signed char item_type,
+                            const char* not_strings) {
+    shared_ptr<Array> array;
+    ARROW_RETURN_NOT_OK(
+        ctx.opts.large_strings
+            ? string_array<int64_t>(items, length, item_type, not_strings,
+                                    ctx.memory_pool, array)
+            : string_array<int32_t>(items, length, item_type, not_strings,
+                                    ctx.memory_pool, array));
+    arrays[c] = array;
+    fields[c] = field(col_name, array->type());
+    return Status::OK();
+  };
+  switch (col->t) {
+    case 0: { // strings, or lists of one numeric type
+      const K* items = kK(col) + offset;
+      // typed by the first item of the column, so that every slice agrees
+      switch (col->n ? kK(col)[0]->t : KC) {
+        case KG: // byte vectors
+          ARROW_RETURN_NOT_OK(append_strings(
+              items, KG, "Unsupported general list structure (mixed types)"));
+          break;
+        case KH:
+          APPEND_LIST(items, KH, H, int16(), validity_h);
+          break;
+        case KI:
+          APPEND_LIST(items, KI, I, int32(), validity_i);
+          break;
+        case KJ:
+          APPEND_LIST(items, KJ, J, int64(), validity_j);
+          break;
+        case KE:
+          APPEND_LIST(items, KE, E, float32(), validity_e);
+          break;
+        case KF:
+          APPEND_LIST(items, KF, F, float64(), validity_f);
+          break;
+        default:
+          ARROW_RETURN_NOT_OK(append_strings(
+              items, KC,
+              "Unsupported general list structure (not string list)"));
+      }
+      break;
+    }
+    case 77: { // anymap (could be string)
+      // each item is fetched once and held until its chars are copied
+      vector<K> items(length);
+      for (int64_t i = 0; i < length; ++i) {
+        items[i] = vi(col, offset + i);
+      }
+      Status st =
+          append_strings(items.data(), KC,
+                         "Unsupported anymap structure (not string list)");
+      for (K item : items) r0(item);
+      ARROW_RETURN_NOT_OK(st);
+      break;
+    }
+    case KB: { // boolean
+      BooleanBuilder builder(ctx.memory_pool);
+      for (int64_t i = offset; i < end; ++i) {
+        ARROW_RETURN_NOT_OK(builder.Append(bool(kG(col)[i])));
+      }
+      APPEND_ARRAY(builder, boolean());
+      break;
+    }
+    case UU: { // guid
+      shared_ptr<Array> array;
+      ARROW_RETURN_NOT_OK(guid_array(col, offset, length, ctx.opts.zero_copy,
+                                     ctx.memory_pool, array));
+      arrays[c] = array;
+      fields[c] = field(col_name, array->type());
+      break;
+    }
+    case KG: // byte
+      APPEND_FIXED(col, uint8(), G, no_nulls);
+      break;
+    case KC: { // char
+      shared_ptr<Array> array;
+      ARROW_RETURN_NOT_OK(
+          ctx.opts.large_strings
+              ? char_array<int64_t>(col, offset, length, ctx.opts.zero_copy,
+                                    ctx.memory_pool, array)
+              : char_array<int32_t>(col, offset, length, ctx.opts.zero_copy,
+                                    ctx.memory_pool, array));
+      arrays[c] = array;
+      fields[c] = field(col_name, array->type());
+      break;
+    }
+    case KH: // short
+      APPEND_FIXED(col, int16(), H, validity_h);
+      break;
+    case KI: // int
+      APPEND_FIXED(col, int32(), I, validity_i);
+      break;
+    case KJ: // long
+      APPEND_FIXED(col, int64(), J, validity_j);
+      break;
+    case KE: // real
+      APPEND_FIXED(col, float32(), E, validity_e);
+      break;
+    case KF: // float
+      APPEND_FIXED(col, float64(), F, validity_f);
+      break;
+    case KD: { // date
+      constexpr I kdb_epoch_offset = 10957;
+      APPEND_SHIFTED(col, date32(), I, validity_shift_i, kdb_epoch_offset);
+      break;
+    }
+    case KS: { // symbol
+      if (ctx.sym_dicts[c]) {
+        shared_ptr<Array> array;
+        ARROW_RETURN_NOT_OK(
+            symbol_array(col, offset, length, ctx.memory_pool, array));
+        arrays[c] = array;
+        fields[c] = field(col_name, array->type());
         break;
       }
-      case KN: { // timespan
-        Time64Builder builder(time64(TimeUnit::NANO), default_memory_pool());
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kJ(col)[i], nj);
+      StringBuilder builder(ctx.memory_pool);
+      S value;
+      for (int64_t i = offset; i < end; ++i) {
+        value = kS(col)[i];
+        if (is_null(value)) {
+          ARROW_RETURN_NOT_OK(builder.AppendNull());
+        } else {
+          ARROW_RETURN_NOT_OK(builder.Append(value));
         }
-        APPEND_ARRAY(builder, time64(TimeUnit::NANO));
-        break;
       }
-      case KT: { // time
-        Time32Builder builder(time32(TimeUnit::MILLI), default_memory_pool());
-        for (size_t i = 0; i < n_rows; ++i) {
-          APPEND_VALUE(kI(col)[i], ni);
+      APPEND_ARRAY(builder, utf8());
+      break;
+    }
+    case KP: { // timestamp
+      constexpr J kdb_epoch_offset = 946684800000000000LL;
+      APPEND_SHIFTED(col, timestamp(TimeUnit::NANO), J, validity_shift_j,
+                     kdb_epoch_offset);
+      break;
+    }
+    case KN: // timespan
+      APPEND_FIXED(col, time64(TimeUnit::NANO), J, validity_j);
+      break;
+    case KT: // time
+      APPEND_FIXED(col, time32(TimeUnit::MILLI), I, validity_i);
+      break;
+    case KM: { // month, as the date of its first day
+      shared_ptr<Array> array;
+      ARROW_RETURN_NOT_OK((converted_array<I, int32_t>(
+          col, offset, length, date32(), month_to_date, ctx.memory_pool,
+          array)));
+      arrays[c] = array;
+      fields[c] = field(col_name, date32());
+      break;
+    }
+    case KU: // minute
+      APPEND_SHIFTED(col, time32(TimeUnit::SECOND), I, validity_scale_i, 60);
+      break;
+    case KV: // second
+      APPEND_FIXED(col, time32(TimeUnit::SECOND), I, validity_i);
+      break;
+    case KZ: { // datetime
+      shared_ptr<Array> array;
+      ARROW_RETURN_NOT_OK((converted_array<F, int64_t>(
+          col, offset, length, timestamp(TimeUnit::MILLI), datetime_to_ms,
+          ctx.memory_pool, array)));
+      arrays[c] = array;
+      fields[c] = field(col_name, timestamp(TimeUnit::MILLI));
+      break;
+    }
+    default:
+      return Status::Invalid("Unsupported column type: " +
+                             to_string(int(col->t)));
+  }
+  return Status::OK();
+}
+// Converts rows [offset, offset + length) of a kdb table
+Status kdb_to_arrow(shared_ptr<RecordBatch>& batch, K table,
+                    const ConvertContext& ctx, int64_t offset,
+                    int64_t length) {
+  PhaseTimer timer(ctx.stats, &WriteStats::convert);
+  K col_vectors = kK(table->k)[1];
+  vector<shared_ptr<Field>> fields(col_vectors->n);
+  vector<shared_ptr<Array>> arrays(col_vectors->n);
+  vector<int> parallel_cols;
+  for (size_t c = 0; c < col_vectors->n; ++c) {
+    if (kK(col_vectors)[c]->t == 77 && ctx.q_arrays.empty()) {
+      ARROW_RETURN_NOT_OK(
+          convert_column(table, c, ctx, offset, length, fields, arrays));
+    } else {
+      parallel_cols.push_back(c);
+    }
+  }
+  ARROW_RETURN_NOT_OK(internal::OptionalParallelFor(
+      ctx.pool != nullptr, parallel_cols.size(),
+      [&](int i) {
+        if (ctx.prefetcher && length) {
+          ctx.prefetcher->reach(parallel_cols[i], offset, ctx.stats);
         }
-        APPEND_ARRAY(builder, time32(TimeUnit::NANO));
+        return convert_column(table, parallel_cols[i], ctx, offset, length,
+                              fields, arrays);
+      },
+      ctx.pool));
+  batch = RecordBatch::Make(make_shared<Schema>(fields), length, arrays);
+  return Status::OK();
+}
+// Converts the columns that need the q thread (anymaps) for the whole table,
+// so that later slices can be converted from any thread
+Status convert_q_columns(K table, ConvertContext& ctx) {
+  K col_vectors = kK(table->k)[1];
+  vector<shared_ptr<Field>> fields(col_vectors->n);
+  ctx.q_arrays.assign(col_vectors->n, nullptr);
+  for (size_t c = 0; c < col_vectors->n; ++c) {
+    if (kK(col_vectors)[c]->t == 77) {
+      ARROW_RETURN_NOT_OK(convert_column(table, c, ctx, 0, table_rows(table),
+                                         fields, ctx.q_arrays));
+    }
+  }
+  return Status::OK();
+}
+Status kdb_to_arrow(shared_ptr<Table>& arrow_table, K table,
+                    const ConvertContext& ctx) {
+  shared_ptr<RecordBatch> batch;
+  ARROW_RETURN_NOT_OK(kdb_to_arrow(batch, table, ctx, 0, table_rows(table)));
+  return Table::FromRecordBatches({batch}).Value(&arrow_table);
+}
+Status parse_codec(const string& codec, Compression::type& type) {
+  if (codec == "snappy")
+    type = Compression::SNAPPY;
+  else if (codec == "zstd")
+    type = Compression::ZSTD;
+  else if (codec == "gzip")
+    type = Compression::GZIP;
+  else if (codec == "uncompressed")
+    type = Compression::UNCOMPRESSED;
+  else
+    return Status::Invalid("Unsupported compression: " + codec);
+  return Status::OK();
+}
+Status parse_encoding(const string& name, parquet::Encoding::type& encoding) {
+  if (name == "plain")
+    encoding = parquet::Encoding::PLAIN;
+  else if (name == "rle")
+    encoding = parquet::Encoding::RLE;
+  else if (name == "delta")
+    encoding = parquet::Encoding::DELTA_BINARY_PACKED;
+  else if (name == "delta_length")
+    encoding = parquet::Encoding::DELTA_LENGTH_BYTE_ARRAY;
+  else if (name == "delta_byte_array")
+    encoding = parquet::Encoding::DELTA_BYTE_ARRAY;
+  else if (name == "byte_stream_split")
+    encoding = parquet::Encoding::BYTE_STREAM_SPLIT;
+  else
+    return Status::Invalid("Unsupported encoding: " + name);
+  return Status::OK();
+}
+// Per-column options take a dictionary from column names to values
+K column_dict(K vals, size_t i) {
+  if (vals->t != 0 || kK(vals)[i]->t != XD) return nullptr;
+  K dict = kK(vals)[i];
+  return kK(dict)[0]->t == KS ? dict : nullptr;
+}
+// Sorted by attribute (s#) or found monotonic in either direction. p# only
+// groups equal values, so parted columns are scanned too.
+template <typename T> bool sorted_column(K col, const T* values) {
+  if (col->u == 1) return true;
+  bool up = true, down = true;
+  for (J i = 1; i < col->n && (up || down); ++i) {
+    up &= values[i - 1] <= values[i];
+    down &= values[i - 1] >= values[i];
+  }
+  return up || down;
+}
+// Whether the first rows of a boolean vector come in runs of 8 or more on
+// average, below which bit packing (PLAIN) is as small as RLE
+bool long_runs(const G* values, int64_t n) {
+  int64_t sample = min<int64_t>(n, 1 << 16);
+  int64_t runs = sample > 0;
+  for (int64_t i = 1; i < sample; ++i) runs += values[i] != values[i - 1];
+  return 8 * runs <= sample;
+}
+// `encoding:`auto picks each column's encoding from its type, attribute and
+// data: RLE for booleans with long runs, DELTA_BINARY_PACKED for sorted
+// integer and temporal columns and BYTE_STREAM_SPLIT for reals and floats.
+// Columns with few distinct values keep dictionary encoding instead.
+void auto_encodings(K table, parquet::WriterProperties::Builder* props) {
+  K col_names = kK(table->k)[0];
+  K col_vectors = kK(table->k)[1];
+  for (J c = 0; c < col_vectors->n; ++c) {
+    K col = kK(col_vectors)[c];
+    if (!col->n) continue; // nothing to judge a session schema by
+    parquet::Encoding::type encoding;
+    bool keep_dict;
+    switch (col->t) {
+      case KB:
+        if (!long_runs(kG(col), col->n)) continue;
+        encoding = parquet::Encoding::RLE;
+        keep_dict = false; // booleans are never dictionary encoded
+        break;
+      case KE:
+        encoding = parquet::Encoding::BYTE_STREAM_SPLIT;
+        keep_dict = few_distinct((const uint32_t*)kE(col), col->n);
+        break;
+      case KF:
+        encoding = parquet::Encoding::BYTE_STREAM_SPLIT;
+        keep_dict = few_distinct((const uint64_t*)kF(col), col->n);
+        break;
+      case KH:
+        if (!sorted_column(col, kH(col))) continue;
+        encoding = parquet::Encoding::DELTA_BINARY_PACKED;
+        keep_dict = few_distinct(kH(col), col->n);
         break;
+      case KI:
+      case KM:
+      case KD:
+      case KU:
+      case KV:
+      case KT:
+        if (!sorted_column(col, kI(col))) continue;
+        encoding = parquet::Encoding::DELTA_BINARY_PACKED;
+        keep_dict = few_distinct(kI(col), col->n);
+        break;
+      case KJ:
+      case KP:
+      case KN:
+        if (!sorted_column(col, kJ(col))) continue;
+        encoding = parquet::Encoding::DELTA_BINARY_PACKED;
+        keep_dict = few_distinct(kJ(col), col->n);
+        break;
+      default: // symbols, enums and strings keep the default dictionary
+        continue;
+    }
+    if (keep_dict) continue;
+    props->disable_dictionary(kS(col_names)[c]);
+    props->encoding(kS(col_names)[c], encoding);
+  }
+}
+// Parquet physical type of a column, or of its leaf values for lists
+parquet::Type::type physical_type(K col) {
+  signed char t = col->t;
+  if (t == 0) t = col->n ? kK(col)[0]->t : KC; // typed by the first item
+  if (t >= 20 && t <= 77) return parquet::Type::BYTE_ARRAY;
+  switch (t) {
+    case KB:
+      return parquet::Type::BOOLEAN;
+    case UU:
+      return parquet::Type::FIXED_LEN_BYTE_ARRAY;
+    case KH:
+    case KI:
+    case KM:
+    case KD:
+    case KU:
+    case KV:
+    case KT:
+      return parquet::Type::INT32;
+    case KJ:
+    case KP:
+    case KN:
+    case KZ:
+      return parquet::Type::INT64;
+    case KE:
+      return parquet::Type::FLOAT;
+    case KF:
+      return parquet::Type::DOUBLE;
+    case KG: // a byte column is written as uint8
+      return col->t == KG ? parquet::Type::INT32 : parquet::Type::BYTE_ARRAY;
+    default: // chars, symbols and strings
+      return parquet::Type::BYTE_ARRAY;
+  }
+}
+// Whether the Parquet writer can encode a physical type that way
+bool encoding_applies(parquet::Encoding::type encoding,
+                      parquet::Type::type type) {
+  switch (encoding) {
+    case parquet::Encoding::RLE:
+      return type == parquet::Type::BOOLEAN;
+    case parquet::Encoding::DELTA_BINARY_PACKED:
+      return type == parquet::Type::INT32 || type == parquet::Type::INT64;
+    case parquet::Encoding::DELTA_LENGTH_BYTE_ARRAY:
+      return type == parquet::Type::BYTE_ARRAY;
+    case parquet::Encoding::DELTA_BYTE_ARRAY:
+      return type == parquet::Type::BYTE_ARRAY ||
+             type == parquet::Type::FIXED_LEN_BYTE_ARRAY;
+    case parquet::Encoding::BYTE_STREAM_SPLIT:
+#if ARROW_VERSION_MAJOR >= 16
+      if (type == parquet::Type::INT32 || type == parquet::Type::INT64 ||
+          type == parquet::Type::FIXED_LEN_BYTE_ARRAY) {
+        return true;
+      }
+#endif
+      return type == parquet::Type::FLOAT || type == parquet::Type::DOUBLE;
+    default:
+      return true;
+  }
+}
+Status set_encodings(K vals, size_t i, K table,
+                     parquet::WriterProperties::Builder* props) {
+  string name;
+  if (opt_symbol(vals, i, name)) {
+    if (name != "auto") {
+      return Status::Invalid(
+          "encoding must be `auto or a dictionary of column encodings");
+    }
+    if (table) auto_encodings(table, props);
+    return Status::OK();
+  }
+  K dict = column_dict(vals, i);
+  if (!dict) {
+    return Status::Invalid(
+        "encoding must be `auto or a dictionary of column encodings");
+  }
+  K cols = kK(dict)[0];
+  K encodings = kK(dict)[1];
+  for (J j = 0; j < cols->n; ++j) {
+    parquet::Encoding::type encoding;
+    if (!opt_symbol(encodings, j, name)) {
+      return Status::Invalid("encoding of a column must be a symbol");
+    }
+    ARROW_RETURN_NOT_OK(parse_encoding(name, encoding));
+    K col_names = table ? kK(table->k)[0] : nullptr;
+    for (J c = 0; col_names && c < col_names->n; ++c) {
+      if (kS(col_names)[c] != kS(cols)[j]) continue;
+      auto type = physical_type(kK(kK(table->k)[1])[c]);
+      if (!encoding_applies(encoding, type)) {
+        return Status::Invalid("encoding ", name, " does not apply to column ",
+                               kS(cols)[j], " of Parquet type ",
+                               parquet::TypeToString(type));
       }
-      default:
-        return Status::Invalid("Unsupported column type: " +
-                               to_string(int(col->t)));
     }
-    if (is_enum) r0(col);
+    // Arrow only falls back from a dictionary to PLAIN
+    props->disable_dictionary(kS(cols)[j]);
+    props->encoding(kS(cols)[j], encoding);
   }
-  arrow_table = Table::Make(make_shared<Schema>(fields), arrays);
   return Status::OK();
 }
+// table, when given, is what `encoding:`auto inspects
 Status
 set_writer_properties(K& opts,
                       shared_ptr<parquet::ArrowWriterProperties>& arrow_props,
-                      std::shared_ptr<parquet::WriterProperties>& parq_props) {
-  if (opts->n) {
-    auto arrow_writer_props = new parquet::ArrowWriterProperties::Builder();
-    auto parq_writer_props = new parquet::WriterProperties::Builder();
+                      std::shared_ptr<parquet::WriterProperties>& parq_props,
+                      MemoryPool* pool = default_memory_pool(),
+                      K table = nullptr,
+                      const vector<parquet::SortingColumn>& sorting = {}) {
+  if (opts->n || !sorting.empty()) {
+    auto arrow_writer_props =
+        make_unique<parquet::ArrowWriterProperties::Builder>();
+    auto parq_writer_props = make_unique<parquet::WriterProperties::Builder>();
+    parq_writer_props->memory_pool(pool);
+    parq_writer_props->set_sorting_columns(sorting);
     K keys = kK(opts)[0];
     K vals = kK(opts)[1];
+    // Encodings first, so enable_dict and disable_dict override them
+    for (size_t i = 0; i < keys->n; ++i) {
+      if (strcmp(kS(keys)[i], "encoding") == 0) {
+        ARROW_RETURN_NOT_OK(
+            set_encodings(vals, i, table, parq_writer_props.get()));
+      }
+    }
     for (size_t i = 0; i < keys->n; ++i) {
       string opt(kS(keys)[i]);
       if (allowed_options.find(opt) == allowed_options.end()) {
@@ -244,22 +1853,45 @@ set_writer_properties(K& opts,
         // parquet writer properties
         if (opt == "compression") {
           string codec;
-          if (kK(vals)[i]->t == -KS) {
-            codec = kK(vals)[i]->s;
-          } else if (vals->t == KS) {
-            codec = kS(vals)[i];
+          Compression::type type;
+          opt_symbol(vals, i, codec);
+          ARROW_RETURN_NOT_OK(parse_codec(codec, type));
+          parq_writer_props->compression(type);
+        }
+        if (opt == "column_compression") {
+          K dict = column_dict(vals, i);
+          if (!dict) {
+            return Status::Invalid(
+                "column_compression must be a dictionary of column codecs");
+          }
+          K cols = kK(dict)[0];
+          for (J j = 0; j < cols->n; ++j) {
+            string codec;
+            Compression::type type;
+            opt_symbol(kK(dict)[1], j, codec);
+            ARROW_RETURN_NOT_OK(parse_codec(codec, type));
+            parq_writer_props->compression(kS(cols)[j], type);
+          }
+        }
+        if (opt == "compression_level") {
+          J level;
+          if (opt_long(vals, i, level)) {
+            parq_writer_props->compression_level(level);
+          } else if (K dict = column_dict(vals, i)) {
+            K cols = kK(dict)[0];
+            for (J j = 0; j < cols->n; ++j) {
+              if (!opt_long(kK(dict)[1], j, level)) {
+                return Status::Invalid("compression_level must be a long");
+              }
+              parq_writer_props->compression_level(kS(cols)[j], level);
+            }
+          } else {
+            return Status::Invalid(
+                "compression_level must be a long or a dictionary of them");
           }
-          if (codec == "snappy")
-            parq_writer_props->compression(Compression::SNAPPY);
-          else if (codec == "zstd")
-            parq_writer_props->compression(Compression::ZSTD);
-          else if (codec == "gzip")
-            parq_writer_props->compression(Compression::GZIP);
-          else
-            return Status::Invalid("Unsupported compression: " + codec);
         }
         if (opt == "enable_dict") {
-          if (kK(vals)[i]->t == KS) {
+          if (vals->t == 0 && kK(vals)[i]->t == KS) {
             for (size_t j = 0; j < kK(vals)[i]->n; ++j) {
               parq_writer_props->enable_dictionary(kS(kK(vals)[i])[j]);
             }
@@ -268,13 +1900,13 @@ set_writer_properties(K& opts,
           } else if (vals->t == KB) {
             if (static_cast<bool>(kG(vals)[i]))
               parq_writer_props->enable_dictionary();
-          } else if (kK(vals)[i]->t == -KB) {
+          } else if (vals->t == 0 && kK(vals)[i]->t == -KB) {
             if (static_cast<bool>(kK(vals)[i]->g))
               parq_writer_props->enable_dictionary();
           }
         }
         if (opt == "disable_dict") {
-          if (kK(vals)[i]->t == KS) {
+          if (vals->t == 0 && kK(vals)[i]->t == KS) {
             for (size_t j = 0; j < kK(vals)[i]->n; ++j) {
               parq_writer_props->disable_dictionary(kS(kK(vals)[i])[j]);
             }
@@ -283,52 +1915,87 @@ set_writer_properties(K& opts,
           } else if (vals->t == KB) {
             if (static_cast<bool>(kG(vals)[i]))
               parq_writer_props->disable_dictionary();
-          } else if (kK(vals)[i]->t == -KB) {
+          } else if (vals->t == 0 && kK(vals)[i]->t == -KB) {
             if (static_cast<bool>(kK(vals)[i]->g))
               parq_writer_props->disable_dictionary();
           }
         }
-        if (opt == "chunk_size") {
-          if (kK(vals)[i]->t == -KJ) {
-            parq_writer_props->max_row_group_length(kK(vals)[i]->j);
-          } else if (vals->t == KJ) {
-            parq_writer_props->max_row_group_length(kJ(vals)[i]);
+        if (opt == "page_index") {
+          bool flag;
+          vector<string> cols;
+          if (opt_bool(vals, i, flag)) {
+            if (flag)
+              parq_writer_props->enable_write_page_index();
+            else
+              parq_writer_props->disable_write_page_index();
+          } else if (opt_symbols(vals, i, cols)) {
+            parq_writer_props->disable_write_page_index();
+            for (const string& col : cols) {
+              parq_writer_props->enable_write_page_index(col);
+            }
+          } else {
+            return Status::Invalid(
+                "page_index must be a boolean or a symbol list of columns");
           }
         }
-        // arrow writer properties
-        if (opt == "use_threads") {
-          if (kK(vals)[i]->t == -KB) {
-            arrow_writer_props->set_use_threads(
-                static_cast<bool>(kK(vals)[i]->g));
-          } else if (vals->t == KB) {
-            arrow_writer_props->set_use_threads(static_cast<bool>(kG(vals)[i]));
+        if (opt == "bloom_filter") {
+          vector<string> cols;
+          parquet::BloomFilterOptions bloom_opts;
+          if (opt_symbols(vals, i, cols)) {
+            for (const string& col : cols) {
+              parq_writer_props->enable_bloom_filter(col, bloom_opts);
+            }
+          } else if (K dict = column_dict(vals, i)) {
+            K fpps = kK(dict)[1];
+            for (J j = 0; j < kK(dict)[0]->n; ++j) {
+              double fpp = fpps->t == KF   ? kF(fpps)[j]
+                           : fpps->t == 0 && kK(fpps)[j]->t == -KF
+                               ? kK(fpps)[j]->f
+                               : 0;
+              if (!(fpp > 0 && fpp < 1)) {
+                return Status::Invalid(
+                    "bloom_filter false positive rates must be in (0, 1)");
+              }
+              bloom_opts.fpp = fpp;
+              parq_writer_props->enable_bloom_filter(kS(kK(dict)[0])[j],
+                                                     bloom_opts);
+            }
+          } else {
+            return Status::Invalid("bloom_filter must be a symbol list of "
+                                   "columns or a dictionary of rates");
           }
         }
-        if (opt == "store_schema") {
-          if (kK(vals)[i]->t == -KB && static_cast<bool>(kK(vals)[i]->g)) {
-            arrow_writer_props->store_schema();
-          } else if (vals->t == KB && static_cast<bool>(kG(vals)[i])) {
-            arrow_writer_props->store_schema();
+        if (opt == "chunk_size") {
+          J chunk_size;
+          if (opt_long(vals, i, chunk_size)) {
+            parq_writer_props->max_row_group_length(chunk_size);
           }
         }
+        // arrow writer properties
+        bool flag;
+        if (opt == "use_threads" && opt_bool(vals, i, flag)) {
+          arrow_writer_props->set_use_threads(flag);
+        }
+        if (opt == "store_schema" && opt_bool(vals, i, flag) && flag) {
+          arrow_writer_props->store_schema();
+        }
       }
     }
     arrow_props = arrow_writer_props->build();
     parq_props = parq_writer_props->build();
-    delete arrow_writer_props;
-    delete parq_writer_props;
   }
   return Status::OK();
 }
 Status set_write_options(dataset::FileSystemDatasetWriteOptions& write_options,
-                         shared_ptr<Table>& arrow_table,
+                         const shared_ptr<Schema>& schema,
                          shared_ptr<fs::FileSystem>& fs,
                          vector<string>& par_cols, filesystem::path& path,
-                         K& opts) {
+                         K& opts, MemoryPool* pool, K table,
+                         const vector<parquet::SortingColumn>& sorting) {
   try {
     vector<shared_ptr<Field>> par_fields;
     for (const string& col_name : par_cols) {
-      par_fields.push_back(arrow_table->schema()->GetFieldByName(col_name));
+      par_fields.push_back(schema->GetFieldByName(col_name));
     }
     auto partitioning =
         make_shared<dataset::HivePartitioning>(make_shared<Schema>(par_fields));
@@ -343,8 +2010,11 @@ Status set_write_options(dataset::FileSystemDatasetWriteOptions& write_options,
     auto options =
         internal::checked_pointer_cast<dataset::ParquetFileWriteOptions>(
             write_options.file_write_options);
-    Status st = set_writer_properties(opts, options->arrow_writer_properties,
-                                      options->writer_properties);
+    Status st =
+        set_writer_properties(opts, options->arrow_writer_properties,
+                              options->writer_properties, pool, table, sorting);
+    // rows must reach each file in table order for sorting_columns to hold
+    write_options.preserve_order = !sorting.empty();
     if (!st.ok()) {
       return Status::Invalid(st.message());
     }
@@ -353,74 +2023,1412 @@ Status set_write_options(dataset::FileSystemDatasetWriteOptions& write_options,
   }
   return Status::OK();
 }
-extern "C" K write_parquet(K table, K path, K k_par_cols, K opts) {
+// Bytes per element of a kdb vector, or 0 if it is not a simple list
+int elem_size(signed char t) {
+  if (t >= 20 && t <= 76) return sizeof(J); // enum index
+  switch (t) {
+    case KB:
+    case KG:
+    case KC:
+      return 1;
+    case KH:
+      return 2;
+    case KI:
+    case KE:
+    case KM:
+    case KD:
+    case KU:
+    case KV:
+    case KT:
+      return 4;
+    case KJ:
+    case KF:
+    case KS: // interned, so equal symbols share a pointer
+    case KP:
+    case KZ:
+    case KN:
+      return 8;
+    case UU:
+      return 16;
+    default:
+      return 0;
+  }
+}
+// Estimated Arrow bytes per row
+int64_t row_bytes(K table) {
+  K col_vectors = kK(table->k)[1];
+  int64_t bytes = 0;
+  for (J c = 0; c < col_vectors->n; ++c) {
+    int size = elem_size(kK(col_vectors)[c]->t);
+    bytes += size ? size : 16; // strings
+  }
+  return bytes;
+}
+// Switches a write whose table would not fit in max_memory to streaming, in
+// slices small enough for the slice converting, the slice encoding and the
+// writer's page buffers and dictionaries to stay under the limit. Those take
+// up to about 16 times the slice for small slices.
+void fit_memory(K table, int64_t max_memory, ConvertOptions& opts) {
+  if (!max_memory) return;
+  int64_t bytes = max<int64_t>(1, row_bytes(table));
+  // a whole-table write holds the table plus about as much being encoded
+  if (!opts.streaming && 2 * table_rows(table) * bytes <= max_memory) return;
+  opts.streaming = true;
+  opts.chunk_size =
+      max<int64_t>(1, min(opts.chunk_size, max_memory / (16 * bytes)));
+}
+// Finds the row range of each partition when the rows are already grouped by
+// the partition columns. `s#/`p# on a single partition column guarantee this;
+// otherwise runs of equal keys are detected and must not repeat.
+bool partition_ranges(K table, const vector<string>& par_cols,
+                      vector<pair<int64_t, int64_t>>& ranges) {
+  K col_names = kK(table->k)[0];
+  K col_vectors = kK(table->k)[1];
+  vector<K> cols;
+  vector<int> widths;
+  for (const string& col_name : par_cols) {
+    for (size_t c = 0; c < col_names->n; ++c) {
+      if (col_name == kS(col_names)[c]) {
+        cols.push_back(kK(col_vectors)[c]);
+        widths.push_back(elem_size(cols.back()->t));
+        if (!widths.back()) return false;
+      }
+    }
+  }
+  bool grouped = cols.size() == 1 && (cols[0]->u == 1 || cols[0]->u == 3);
+  auto same = [&](int64_t i, int64_t j) {
+    for (size_t c = 0; c < cols.size(); ++c) {
+      if (memcmp(kG(cols[c]) + i * widths[c], kG(cols[c]) + j * widths[c],
+                 widths[c]))
+        return false;
+    }
+    return true;
+  };
+  unordered_set<string> seen;
+  int64_t n_rows = table_rows(table);
+  for (int64_t start = 0, i = 1; i <= n_rows; ++i) {
+    if (i < n_rows && same(start, i)) continue;
+    if (!grouped) {
+      string key;
+      for (size_t c = 0; c < cols.size(); ++c) {
+        key.append((S)kG(cols[c]) + start * widths[c], widths[c]);
+      }
+      if (!seen.insert(key).second) return false;
+    }
+    ranges.emplace_back(start, i - start);
+    start = i;
+  }
+  return true;
+}
+// Output stream that adds the time spent writing to the io phase. Called from
+// writer threads, so CPU time is taken from the calling thread's clock.
+class TimedOutputStream : public io::OutputStream {
+public:
+  TimedOutputStream(shared_ptr<io::OutputStream> raw, WriteStats* stats)
+      : raw_(move(raw)), stats_(stats) {}
+  Status Write(const void* data, int64_t nbytes) override {
+    PhaseTimer timer(stats_, &WriteStats::io, CLOCK_THREAD_CPUTIME_ID);
+    return raw_->Write(data, nbytes);
+  }
+  Status Write(const shared_ptr<Buffer>& data) override {
+    PhaseTimer timer(stats_, &WriteStats::io, CLOCK_THREAD_CPUTIME_ID);
+    return raw_->Write(data);
+  }
+  Status Flush() override {
+    PhaseTimer timer(stats_, &WriteStats::io, CLOCK_THREAD_CPUTIME_ID);
+    return raw_->Flush();
+  }
+  Status Close() override {
+    PhaseTimer timer(stats_, &WriteStats::io, CLOCK_THREAD_CPUTIME_ID);
+    return raw_->Close();
+  }
+  bool closed() const override { return raw_->closed(); }
+  Result<int64_t> Tell() const override { return raw_->Tell(); }
+
+private:
+  shared_ptr<io::OutputStream> raw_;
+  WriteStats* stats_;
+};
+// File stream for the output options. Writes are gathered in two page-aligned
+// buffers: one fills while the other is written with pwrite on a background
+// thread. With atomic the file is written under a hidden temporary name,
+// which dataset readers skip, and only renamed into place by Close.
+class FileSink : public io::OutputStream {
+public:
+  static Result<shared_ptr<io::OutputStream>>
+  Open(const string& path, const OutputOptions& opts) {
+    shared_ptr<FileSink> sink(new FileSink(path, opts));
+    ARROW_RETURN_NOT_OK(sink->OpenFile());
+    return sink;
+  }
+  ~FileSink() override {
+    if (fd_ >= 0) {
+      // not closed, so the write failed: leave no partial file
+      if (pending_.valid()) pending_.wait();
+      close(fd_);
+      if (!tmp_.empty()) unlink(tmp_.c_str());
+    }
+    free(buffer_);
+    free(spare_);
+  }
+  Status Write(const void* data, int64_t nbytes) override {
+    auto bytes = static_cast<const uint8_t*>(data);
+    while (nbytes > 0) {
+      int64_t n = min(nbytes, capacity_ - filled_);
+      memcpy(buffer_ + filled_, bytes, n);
+      filled_ += n;
+      bytes += n;
+      nbytes -= n;
+      if (filled_ == capacity_) ARROW_RETURN_NOT_OK(Submit());
+    }
+    return Status::OK();
+  }
+  Status Close() override {
+    if (fd_ < 0) return Status::OK();
+    Status st = Wait();
+    if (st.ok() && filled_) {
+      // the tail is not a whole number of blocks
+      if (direct_) fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+      st = WriteAt(buffer_, filled_, offset_);
+      offset_ += filled_;
+      filled_ = 0;
+    }
+    if (st.ok() && opts_.fsync != OutputOptions::Sync::none && fsync(fd_)) {
+      st = Error("fsync");
+    }
+    if (close(fd_) && st.ok()) st = Error("close");
+    fd_ = -1;
+    if (!tmp_.empty()) {
+      if (st.ok() && rename(tmp_.c_str(), path_.c_str())) st = Error("rename");
+      if (!st.ok()) unlink(tmp_.c_str());
+    }
+    if (st.ok() && opts_.fsync == OutputOptions::Sync::all) {
+      string dir = filesystem::path(path_).parent_path().string();
+      int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+      if (dir_fd < 0 || fsync(dir_fd)) st = Error("fsync directory");
+      if (dir_fd >= 0) close(dir_fd);
+    }
+    return st;
+  }
+  bool closed() const override { return fd_ < 0; }
+  Result<int64_t> Tell() const override { return offset_ + filled_; }
+
+private:
+  FileSink(const string& path, const OutputOptions& opts)
+      : path_(path), opts_(opts) {}
+  Status Error(const string& call) const {
+    return Status::IOError(call, " failed for ", path_, ": ", strerror(errno));
+  }
+  Status OpenFile() {
+    const int64_t block = 4096, default_buffer = 1 << 23;
+    capacity_ = opts_.write_buffer ? opts_.write_buffer : default_buffer;
+    capacity_ = (capacity_ + block - 1) / block * block;
+    if (posix_memalign((void**)&buffer_, block, capacity_) ||
+        posix_memalign((void**)&spare_, block, capacity_)) {
+      return Status::OutOfMemory("write_buffer of ", capacity_, " bytes");
+    }
+    string file = path_;
+    if (opts_.atomic) {
+      static atomic<int64_t> counter{0};
+      filesystem::path target(path_);
+      tmp_ = (target.parent_path() /
+              ("." + target.filename().string() + ".tmp" +
+               to_string(getpid()) + "_" + to_string(counter++)))
+                 .string();
+      file = tmp_;
+    }
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    direct_ = opts_.direct_io;
+    fd_ = open(file.c_str(), flags | (direct_ ? O_DIRECT : 0), 0666);
+    if (fd_ < 0 && direct_ && errno == EINVAL) {
+      // the filesystem does not support O_DIRECT
+      direct_ = false;
+      fd_ = open(file.c_str(), flags, 0666);
+    }
+    if (fd_ < 0) {
+      tmp_.clear();
+      return Error("open");
+    }
+    return Status::OK();
+  }
+  Status WriteAt(const uint8_t* data, int64_t size, int64_t offset) {
+    while (size > 0) {
+      ssize_t n = pwrite(fd_, data, size, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return Error("pwrite");
+      data += n;
+      size -= n;
+      offset += n;
+    }
+    return Status::OK();
+  }
+  Status Wait() { return pending_.valid() ? pending_.get() : Status::OK(); }
+  // Starts writing the full buffer and carries on filling the other one
+  Status Submit() {
+    ARROW_RETURN_NOT_OK(Wait());
+    pending_ = async(launch::async, [this, data = buffer_, size = filled_,
+                                     offset = offset_] {
+      return WriteAt(data, size, offset);
+    });
+    offset_ += filled_;
+    filled_ = 0;
+    swap(buffer_, spare_);
+    return Status::OK();
+  }
+
+  string path_, tmp_;
+  OutputOptions opts_;
+  int fd_ = -1;
+  bool direct_ = false;
+  uint8_t* buffer_ = nullptr;
+  uint8_t* spare_ = nullptr;
+  int64_t capacity_ = 0, filled_ = 0;
+  int64_t offset_ = 0; // file offset of buffer_
+  future<Status> pending_;
+};
+// Local filesystem writing through FileSink, for flat files, partition files
+// and the dataset writer alike
+class OutputFileSystem : public fs::LocalFileSystem {
+public:
+  explicit OutputFileSystem(const OutputOptions& opts) : opts_(opts) {}
+  using fs::LocalFileSystem::OpenOutputStream;
+  Result<shared_ptr<io::OutputStream>> OpenOutputStream(
+      const string& path,
+      const shared_ptr<const KeyValueMetadata>& metadata) override {
+    if (!opts_.custom()) {
+      return fs::LocalFileSystem::OpenOutputStream(path, metadata);
+    }
+    return FileSink::Open(path, opts_);
+  }
+
+private:
+  OutputOptions opts_;
+};
+// Opens a file for writing, timed and recorded when stats are on
+Status open_output(fs::FileSystem& fs, const string& file, WriteStats* stats,
+                   shared_ptr<io::OutputStream>& outfile) {
+  ARROW_ASSIGN_OR_RAISE(outfile, fs.OpenOutputStream(file));
+  if (stats) {
+    outfile = make_shared<TimedOutputStream>(outfile, stats);
+    lock_guard<mutex> lock(stats->files_mutex);
+    stats->files.push_back(file);
+  }
+  return Status::OK();
+}
+// Writes each partition range straight to its Hive directory, in parallel and
+// from zero-copy slices, instead of scattering rows through the dataset writer
+Status
+write_partitions(const shared_ptr<Table>& arrow_table,
+                 const vector<pair<int64_t, int64_t>>& ranges,
+                 const vector<string>& par_cols, const ConvertContext& ctx,
+                 const dataset::FileSystemDatasetWriteOptions& write_options) {
+  auto options =
+      internal::checked_pointer_cast<dataset::ParquetFileWriteOptions>(
+          write_options.file_write_options);
+  string basename = write_options.basename_template;
+  basename.replace(basename.find("{i}"), 3, "0");
+  vector<int> par_idx;
+  for (const string& col_name : par_cols) {
+    par_idx.push_back(arrow_table->schema()->GetFieldIndex(col_name));
+  }
+  shared_ptr<Table> data = arrow_table;
+  vector<int> drop = par_idx;
+  sort(drop.rbegin(), drop.rend());
+  for (int idx : drop) {
+    ARROW_ASSIGN_OR_RAISE(data, data->RemoveColumn(idx));
+  }
+  return internal::ParallelFor(
+      ranges.size(),
+      [&](int i) -> Status {
+        auto [start, length] = ranges[i];
+        vector<compute::Expression> keys;
+        for (int idx : par_idx) {
+          shared_ptr<Scalar> value;
+          ARROW_ASSIGN_OR_RAISE(value,
+                                arrow_table->column(idx)->GetScalar(start));
+          auto ref = compute::field_ref(arrow_table->field(idx)->name());
+          if (!value->is_valid) {
+            keys.push_back(compute::is_null(ref));
+            continue;
+          }
+          if (value->type->id() == Type::DICTIONARY) {
+            ARROW_ASSIGN_OR_RAISE(
+                value, internal::checked_cast<const DictionaryScalar&>(*value)
+                           .GetEncodedValue());
+          }
+          keys.push_back(compute::equal(ref, compute::literal(value)));
+        }
+        dataset::PartitionPathFormat format;
+        ARROW_ASSIGN_OR_RAISE(
+            format, write_options.partitioning->Format(compute::and_(keys)));
+        string dir = write_options.base_dir + "/" + format.directory;
+        ARROW_RETURN_NOT_OK(write_options.filesystem->CreateDir(dir));
+        shared_ptr<io::OutputStream> outfile;
+        ARROW_RETURN_NOT_OK(open_output(*write_options.filesystem,
+                                        dir + "/" + basename, ctx.stats,
+                                        outfile));
+        ARROW_RETURN_NOT_OK(parquet::arrow::WriteTable(
+            *data->Slice(start, length), ctx.memory_pool, outfile,
+            parquet::DEFAULT_MAX_ROW_GROUP_LENGTH, options->writer_properties,
+            options->arrow_writer_properties));
+        return outfile->Close();
+      },
+      io::default_io_context().executor());
+}
+// Writes a flat file one row group at a time. Slice N is encoded on a
+// background thread while slice N+1 is converted on the q thread, and each
+// batch is released on the q thread so zero-copy buffers are unpinned there.
+Status write_streaming(K table, const ConvertContext& ctx,
+                       shared_ptr<io::OutputStream> outfile,
+                       shared_ptr<parquet::WriterProperties> parq_props,
+                       shared_ptr<parquet::ArrowWriterProperties> arrow_props) {
+  int64_t n_rows = table_rows(table);
+  int64_t chunk_size = ctx.opts.chunk_size;
+  shared_ptr<RecordBatch> batch;
+  ARROW_RETURN_NOT_OK(
+      kdb_to_arrow(batch, table, ctx, 0, min(chunk_size, n_rows)));
+  unique_ptr<parquet::arrow::FileWriter> writer;
+  ARROW_ASSIGN_OR_RAISE(writer, parquet::arrow::FileWriter::Open(
+                                    *batch->schema(), ctx.memory_pool,
+                                    outfile, parq_props, arrow_props));
+  for (int64_t offset = batch->num_rows(); batch;) {
+    shared_ptr<RecordBatch> encoding = move(batch);
+    future<Status> encoded = async(launch::async, [&] {
+      PhaseTimer timer(ctx.stats, &WriteStats::encode);
+      // each slice is flushed as its own row group
+      ARROW_RETURN_NOT_OK(writer->NewBufferedRowGroup());
+      return writer->WriteRecordBatch(*encoding);
+    });
+    Status st;
+    if (offset < n_rows) {
+      int64_t length = min(chunk_size, n_rows - offset);
+      st = kdb_to_arrow(batch, table, ctx, offset, length);
+      offset += length;
+    }
+    ARROW_RETURN_NOT_OK(encoded.get());
+    ARROW_RETURN_NOT_OK(st);
+  }
+  PhaseTimer timer(ctx.stats, &WriteStats::encode);
+  ARROW_RETURN_NOT_OK(writer->Close());
+  return outfile->Close();
+}
+// Record batch reader fed from the q thread. Push blocks while the queue is
+// full, which bounds how far conversion runs ahead of the dataset writer.
+class BatchQueue : public RecordBatchReader {
+public:
+  BatchQueue(shared_ptr<Schema> schema, size_t capacity)
+      : schema_(move(schema)), capacity_(capacity) {}
+  shared_ptr<Schema> schema() const override { return schema_; }
+  Status ReadNext(shared_ptr<RecordBatch>* batch) override {
+    unique_lock<mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return !queue_.empty() || closed_; });
+    if (queue_.empty()) {
+      *batch = nullptr;
+      return status_;
+    }
+    *batch = move(queue_.front());
+    queue_.pop_front();
+    cond_.notify_all();
+    return Status::OK();
+  }
+  // Returns false once the reader side has stopped consuming
+  bool Push(shared_ptr<RecordBatch> batch) {
+    unique_lock<mutex> lock(mutex_);
+    cond_.wait(lock,
+               [this] { return queue_.size() < capacity_ || cancelled_; });
+    if (cancelled_) return false;
+    queue_.push_back(move(batch));
+    cond_.notify_all();
+    return true;
+  }
+  // End of input; a non-OK status is passed on to the reader
+  void Close(const Status& status) {
+    lock_guard<mutex> lock(mutex_);
+    closed_ = true;
+    status_ = status;
+    cond_.notify_all();
+  }
+  void Cancel() {
+    lock_guard<mutex> lock(mutex_);
+    cancelled_ = true;
+    cond_.notify_all();
+  }
+
+private:
+  shared_ptr<Schema> schema_;
+  size_t capacity_;
+  mutex mutex_;
+  condition_variable cond_;
+  deque<shared_ptr<RecordBatch>> queue_;
+  bool closed_ = false, cancelled_ = false;
+  Status status_;
+};
+// Streams the table into a Hive partitioned dataset in chunk_size slices.
+// Conversion stays on the q thread while the dataset writer runs on its own.
+Status
+write_dataset_streaming(K table, const ConvertContext& ctx,
+                        const shared_ptr<Schema>& schema,
+                        dataset::FileSystemDatasetWriteOptions& write_options) {
+  int64_t n_rows = table_rows(table);
+  int64_t chunk_size = ctx.opts.chunk_size;
+  auto queue = make_shared<BatchQueue>(schema, 1);
+  shared_ptr<dataset::Scanner> scanner;
+  ARROW_ASSIGN_OR_RAISE(
+      scanner, dataset::ScannerBuilder::FromRecordBatchReader(queue)->Finish());
+  future<Status> written = async(launch::async, [&] {
+    PhaseTimer timer(ctx.stats, &WriteStats::encode);
+    Status st = dataset::FileSystemDataset::Write(write_options, scanner);
+    queue->Cancel();
+    return st;
+  });
+  Status st;
+  for (int64_t offset = 0; offset < n_rows; offset += chunk_size) {
+    shared_ptr<RecordBatch> batch;
+    st = kdb_to_arrow(batch, table, ctx, offset,
+                      min(chunk_size, n_rows - offset));
+    if (!st.ok() || !queue->Push(move(batch))) break;
+  }
+  queue->Close(st);
+  Status write_st = written.get();
+  ARROW_RETURN_NOT_OK(st);
+  return write_st;
+}
+// Arguments of a write, validated on the q thread
+struct WriteRequest {
+  filesystem::path path;
+  vector<string> par_cols;
+  K opts;
+  // in-memory targets used instead of the local filesystem when set
+  shared_ptr<io::OutputStream> sink; // flat file
+  shared_ptr<fs::FileSystem> fs;     // partitioned dataset
+  // set for stats or max_memory; keeps itself alive while buffers remain
+  shared_ptr<WritePool> pool;
+  unique_ptr<WriteStats> stats;
+  ConvertContext ctx;
+};
+// path is null for in-memory writes
+Status parse_write_request(K table, K path, K k_par_cols, K opts,
+                           WriteRequest& req) {
   if (table->t != XT) {
-    return krr((S) "not a table");
+    return Status::Invalid("not a table");
   }
-  if (path->t != -KS) {
-    return krr((S) "Path not a symbol");
+  if (path && path->t != -KS) {
+    return Status::Invalid("Path not a symbol");
   }
   if (!(k_par_cols->t == -KS || k_par_cols->t == KS || k_par_cols->n == 0)) {
-    return krr((S) "Partition column(s) must be symbol/symbol list");
+    return Status::Invalid("Partition column(s) must be symbol/symbol list");
   }
   if (opts->t != XD) {
-    return krr((S) "opts not a dictionary");
+    return Status::Invalid("opts not a dictionary");
   }
-  vector<string> par_cols;
   if (k_par_cols->t == -KS) {
     if (!is_null(k_par_cols->s)) {
       if (!is_in(k_par_cols->s, kK(table->k)[0])) {
-        return krr((S) "Partition column does not exist");
+        return Status::Invalid("Partition column does not exist");
       }
-      par_cols.emplace_back(k_par_cols->s);
+      req.par_cols.emplace_back(k_par_cols->s);
     }
   } else if (k_par_cols->t == KS) {
     for (size_t i = 0; i < k_par_cols->n; ++i) {
       if (!is_null(kS(k_par_cols)[i])) {
         if (!is_in(kS(k_par_cols)[i], kK(table->k)[0])) {
-          return krr((S) "Partition column does not exist");
+          return Status::Invalid("Partition column does not exist");
         }
-        par_cols.emplace_back(kS(k_par_cols)[i]);
+        req.par_cols.emplace_back(kS(k_par_cols)[i]);
       }
     }
   }
-  auto abs_path = filesystem::absolute(filesystem::path(path->s));
-  static string k_err;
-  Status status;
+  req.path = path ? filesystem::absolute(filesystem::path(path->s))
+                 : filesystem::path("parquet");
+  req.opts = opts;
+  ConvertOptions conv_opts;
+  ARROW_RETURN_NOT_OK(set_convert_options(opts, conv_opts));
+  fit_memory(table, conv_opts.max_memory, conv_opts);
+  if (conv_opts.streaming && !req.par_cols.empty()) {
+    conv_opts.zero_copy = false; // batches are released on writer threads
+  }
+  MemoryPool* pool = conv_opts.memory_pool;
+  if (conv_opts.max_memory || conv_opts.stats) {
+    req.pool = make_shared<WritePool>(pool, conv_opts.max_memory);
+    pool = req.pool.get();
+  }
+  if (conv_opts.stats) {
+    req.stats = make_unique<WriteStats>(req.pool);
+    req.ctx.stats = req.stats.get();
+  }
+  req.ctx.memory_pool = pool;
+  PhaseTimer timer(req.stats.get(), &WriteStats::prepare);
+  return prepare_convert(table, conv_opts, req.ctx);
+}
+// The table's sort keys as sorting_columns of files without the partition
+// columns, which are constant within each file
+vector<parquet::SortingColumn> file_sorting(K table, const ConvertContext& ctx,
+                                            const vector<string>& par_cols) {
+  K col_names = kK(table->k)[0];
+  auto is_par_col = [&](J c) {
+    return find(par_cols.begin(), par_cols.end(), kS(col_names)[c]) !=
+           par_cols.end();
+  };
+  vector<parquet::SortingColumn> sorting;
+  for (parquet::SortingColumn key : ctx.sort_keys) {
+    if (is_par_col(key.column_idx)) continue;
+    int32_t skipped = 0;
+    for (J c = 0; c < key.column_idx; ++c) skipped += is_par_col(c);
+    key.column_idx -= skipped;
+    sorting.push_back(key);
+  }
+  return sorting;
+}
+// Converts and writes a table. Does not call back into q, so it can run off
+// the q thread once the request has been prepared.
+Status write_table(K table, WriteRequest& req) {
+  const ConvertContext& ctx = req.ctx;
   shared_ptr<Table> arrow_table;
-  CHECK_STATUS(kdb_to_arrow(arrow_table, table));
+  // Conversion allocates too, and this can run on an async worker
   try {
-    if (par_cols.empty()) {
+    if (!ctx.opts.streaming) {
+      ARROW_RETURN_NOT_OK(kdb_to_arrow(arrow_table, table, ctx));
+    }
+    if (req.par_cols.empty()) {
       // No partition columns, save as flat file
-      shared_ptr<io::FileOutputStream> outfile;
-      CHECK_STATUS(
-          io::FileOutputStream::Open(abs_path.string()).Value(&outfile));
-      std::shared_ptr<parquet::ArrowWriterProperties> arrow_props;
+      OutputFileSystem local_fs(ctx.opts.output);
+      shared_ptr<io::OutputStream> outfile = req.sink;
+      if (!outfile) {
+        ARROW_RETURN_NOT_OK(
+            open_output(local_fs, req.path.string(), ctx.stats, outfile));
+      }
+      std::shared_ptr<parquet::ArrowWriterProperties> arrow_props =
+          parquet::default_arrow_writer_properties();
       std::shared_ptr<parquet::WriterProperties> parq_props =
           parquet::default_writer_properties();
-      CHECK_STATUS(set_writer_properties(opts, arrow_props, parq_props));
-      CHECK_STATUS(parquet::arrow::WriteTable(
-          *arrow_table, default_memory_pool(), outfile,
+      ARROW_RETURN_NOT_OK(set_writer_properties(
+          req.opts, arrow_props, parq_props, ctx.memory_pool, table,
+          file_sorting(table, ctx, req.par_cols)));
+      if (ctx.opts.streaming) {
+        return write_streaming(table, ctx, outfile, parq_props, arrow_props);
+      }
+      PhaseTimer timer(ctx.stats, &WriteStats::encode);
+      ARROW_RETURN_NOT_OK(parquet::arrow::WriteTable(
+          *arrow_table, ctx.memory_pool, outfile,
           parquet::DEFAULT_MAX_ROW_GROUP_LENGTH, parq_props, arrow_props));
+      return outfile->Close();
+    }
+    // Save as Hive Partitioned table
+    shared_ptr<Schema> schema;
+    if (ctx.opts.streaming) {
+      shared_ptr<RecordBatch> empty;
+      ARROW_RETURN_NOT_OK(kdb_to_arrow(empty, table, ctx, 0, 0));
+      schema = empty->schema();
     } else {
-      // Save as Hive Partitioned table
-      auto write_dataset = make_shared<TableBatchReader>(arrow_table);
-      auto write_scanner_builder =
-          dataset::ScannerBuilder::FromRecordBatchReader(write_dataset);
-      shared_ptr<dataset::Scanner> write_scanner;
-      CHECK_STATUS(write_scanner_builder->Finish().Value(&write_scanner));
-      shared_ptr<fs::FileSystem> fs;
-      CHECK_STATUS(fs::FileSystemFromUriOrPath(abs_path.parent_path().string())
-                       .Value(&fs));
-      dataset::FileSystemDatasetWriteOptions write_options;
-      CHECK_STATUS(set_write_options(write_options, arrow_table, fs, par_cols,
-                                     abs_path, opts));
-      CHECK_STATUS(
-          dataset::FileSystemDataset::Write(write_options, write_scanner));
+      schema = arrow_table->schema();
+    }
+    shared_ptr<fs::FileSystem> fs = req.fs;
+    if (!fs) fs = make_shared<OutputFileSystem>(ctx.opts.output);
+    dataset::FileSystemDatasetWriteOptions write_options;
+    ARROW_RETURN_NOT_OK(set_write_options(write_options, schema, fs,
+                                          req.par_cols, req.path, req.opts,
+                                          ctx.memory_pool, table,
+                                          file_sorting(table, ctx,
+                                                       req.par_cols)));
+    if (ctx.opts.max_memory) {
+      // flush row groups at the slice size chosen by fit_memory
+      write_options.max_rows_per_group = ctx.opts.chunk_size;
     }
+    if (ctx.stats) {
+      write_options.writer_post_finish = [&ctx](dataset::FileWriter* writer) {
+        lock_guard<mutex> lock(ctx.stats->files_mutex);
+        ctx.stats->files.push_back(writer->destination().path);
+        return Status::OK();
+      };
+    }
+    vector<pair<int64_t, int64_t>> ranges;
+    if (ctx.opts.streaming) {
+      return write_dataset_streaming(table, ctx, schema, write_options);
+    }
+    PhaseTimer timer(ctx.stats, &WriteStats::encode);
+    // ranges are found in table order, not sort_by order
+    if (ctx.order.empty() && partition_ranges(table, req.par_cols, ranges)) {
+      return write_partitions(arrow_table, ranges, req.par_cols, ctx,
+                              write_options);
+    }
+    auto write_dataset = make_shared<TableBatchReader>(arrow_table);
+    auto write_scanner_builder =
+        dataset::ScannerBuilder::FromRecordBatchReader(write_dataset);
+    shared_ptr<dataset::Scanner> write_scanner;
+    ARROW_RETURN_NOT_OK(write_scanner_builder->Finish().Value(&write_scanner));
+    return dataset::FileSystemDataset::Write(write_options, write_scanner);
   } catch (const exception& e) {
-    k_err = e.what();
-    return krr((S)k_err.c_str());
+    return Status::Invalid(e.what());
+  }
+}
+K phase_times(const vector<pair<string, PhaseTime*>>& phases) {
+  K names = ktn(KS, phases.size());
+  K wall = ktn(KN, phases.size());
+  K cpu = ktn(KN, phases.size());
+  for (size_t i = 0; i < phases.size(); ++i) {
+    kS(names)[i] = ss((S)phases[i].first.c_str());
+    kJ(wall)[i] = phases[i].second->wall;
+    kJ(cpu)[i] = phases[i].second->cpu;
+  }
+  K cols = ktn(KS, 3);
+  kS(cols)[0] = ss((S) "phase");
+  kS(cols)[1] = ss((S) "wall");
+  kS(cols)[2] = ss((S) "cpu");
+  return xT(xD(cols, knk(3, names, wall, cpu)));
+}
+// Stats of a finished write as a dictionary. Row groups, sizes and encodings
+// are read back from the footers of the files written.
+Status stats_dict(WriteStats& stats, K& result) {
+  PhaseTime total, encode;
+  total.wall = clock_ns(CLOCK_MONOTONIC) - stats.start_wall;
+  total.cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - stats.start_cpu;
+  // The encode timers include the writes made while encoding
+  encode.wall = max<int64_t>(0, stats.encode.wall - stats.io.wall);
+  encode.cpu = max<int64_t>(0, stats.encode.cpu - stats.io.cpu);
+  J rows = 0, row_groups = 0;
+  vector<string> columns;
+  unordered_map<string, size_t> column_index;
+  vector<J> uncompressed, compressed;
+  vector<set<string>> encodings;
+  for (const string& file : stats.files) {
+    shared_ptr<io::ReadableFile> infile;
+    ARROW_ASSIGN_OR_RAISE(infile, io::ReadableFile::Open(file));
+    shared_ptr<parquet::FileMetaData> meta;
+    PARQUET_CATCH_NOT_OK(meta = parquet::ReadMetaData(infile));
+    rows += meta->num_rows();
+    row_groups += meta->num_row_groups();
+    for (int g = 0; g < meta->num_row_groups(); ++g) {
+      auto group = meta->RowGroup(g);
+      for (int c = 0; c < group->num_columns(); ++c) {
+        auto chunk = group->ColumnChunk(c);
+        string name = chunk->path_in_schema()->ToDotString();
+        auto [it, added] = column_index.emplace(name, columns.size());
+        if (added) {
+          columns.push_back(name);
+          uncompressed.push_back(0);
+          compressed.push_back(0);
+          encodings.emplace_back();
+        }
+        uncompressed[it->second] += chunk->total_uncompressed_size();
+        compressed[it->second] += chunk->total_compressed_size();
+        for (parquet::Encoding::type e : chunk->encodings()) {
+          encodings[it->second].insert(parquet::EncodingToString(e));
+        }
+      }
+    }
+  }
+  K names = ktn(KS, columns.size());
+  K k_uncompressed = ktn(KJ, columns.size());
+  K k_compressed = ktn(KJ, columns.size());
+  K k_encodings = ktn(0, columns.size());
+  for (size_t c = 0; c < columns.size(); ++c) {
+    kS(names)[c] = ss((S)columns[c].c_str());
+    kJ(k_uncompressed)[c] = uncompressed[c];
+    kJ(k_compressed)[c] = compressed[c];
+    K e = ktn(KS, 0);
+    for (const string& name : encodings[c]) js(&e, ss((S)name.c_str()));
+    kK(k_encodings)[c] = e;
+  }
+  K col_keys = ktn(KS, 4);
+  kS(col_keys)[0] = ss((S) "column");
+  kS(col_keys)[1] = ss((S) "uncompressed");
+  kS(col_keys)[2] = ss((S) "compressed");
+  kS(col_keys)[3] = ss((S) "encodings");
+  K col_stats = xT(xD(col_keys, knk(4, names, k_uncompressed, k_compressed,
+                                    k_encodings)));
+  K keys = ktn(KS, 6);
+  kS(keys)[0] = ss((S) "rows");
+  kS(keys)[1] = ss((S) "row_groups");
+  kS(keys)[2] = ss((S) "files");
+  kS(keys)[3] = ss((S) "peak_memory");
+  kS(keys)[4] = ss((S) "phases");
+  kS(keys)[5] = ss((S) "columns");
+  K phases = phase_times({{"prepare", &stats.prepare},
+                          {"convert", &stats.convert},
+                          {"fault", &stats.fault},
+                          {"encode", &encode},
+                          {"io", &stats.io},
+                          {"total", &total}});
+  result = xD(keys, knk(6, kj(rows), kj(row_groups), kj(stats.files.size()),
+                        kj(stats.memory_pool->max_memory()), phases,
+                        col_stats));
+  return Status::OK();
+}
+extern "C" K write_parquet(K table, K path, K k_par_cols, K opts) {
+  static string k_err;
+  Status status;
+  WriteRequest req;
+  CHECK_STATUS(parse_write_request(table, path, k_par_cols, opts, req));
+  CHECK_STATUS(write_table(table, req));
+  if (!req.stats) return (K)0;
+  K result;
+  CHECK_STATUS(stats_dict(*req.stats, result));
+  return result;
+}
+// Buffer write_parquet_bytes encodes flat files into, kept between calls so
+// that writes of similar size reuse its memory
+static shared_ptr<ResizableBuffer> bytes_buffer;
+static const int64_t max_kept_buffer = 1LL << 28;
+Status write_bytes(K table, K k_par_cols, K opts, K& result) {
+  WriteRequest req;
+  ARROW_RETURN_NOT_OK(
+      parse_write_request(table, nullptr, k_par_cols, opts, req));
+  if (req.stats) {
+    return Status::Invalid("stats is only supported by write_parquet");
   }
+  if (req.par_cols.empty()) {
+    if (!bytes_buffer) {
+      ARROW_ASSIGN_OR_RAISE(bytes_buffer, AllocateResizableBuffer(0));
+    }
+    auto sink = make_shared<io::BufferOutputStream>(bytes_buffer);
+    req.sink = sink;
+    Status st = write_table(table, req);
+    shared_ptr<Buffer> data;
+    if (st.ok()) st = sink->Finish().Value(&data);
+    if (st.ok()) {
+      result = ktn(KG, data->size());
+      memcpy(kG(result), data->data(), data->size());
+    }
+    if (bytes_buffer->capacity() > max_kept_buffer) bytes_buffer.reset();
+    return st;
+  }
+  // Partitions go to an in-memory filesystem, read back per file
+  auto mem_fs = make_shared<fs::internal::MockFileSystem>(fs::kNoTime);
+  req.fs = mem_fs;
+  ARROW_RETURN_NOT_OK(write_table(table, req));
+  fs::FileSelector selector;
+  selector.base_dir = req.path.string();
+  selector.recursive = true;
+  vector<fs::FileInfo> infos;
+  ARROW_ASSIGN_OR_RAISE(infos, mem_fs->GetFileInfo(selector));
+  sort(infos.begin(), infos.end(), fs::FileInfo::ByPath{});
+  vector<pair<string, shared_ptr<Buffer>>> files;
+  for (const fs::FileInfo& info : infos) {
+    if (!info.IsFile()) continue;
+    shared_ptr<io::RandomAccessFile> file;
+    shared_ptr<Buffer> data;
+    ARROW_ASSIGN_OR_RAISE(file, mem_fs->OpenInputFile(info.path()));
+    ARROW_ASSIGN_OR_RAISE(data, file->ReadAt(0, info.size()));
+    files.emplace_back(info.path().substr(selector.base_dir.size() + 1),
+                       data);
+  }
+  K names = ktn(KS, 0);
+  K values = ktn(0, 0);
+  for (auto& [name, data] : files) {
+    K bytes = ktn(KG, data->size());
+    memcpy(kG(bytes), data->data(), data->size());
+    js(&names, ss((S)name.c_str()));
+    jk(&values, bytes);
+  }
+  result = xD(names, values);
+  return Status::OK();
+}
+extern "C" K write_parquet_bytes(K table, K k_par_cols, K opts) {
+  static string k_err;
+  Status status;
+  K result;
+  CHECK_STATUS(write_bytes(table, k_par_cols, opts, result));
+  return result;
+}
+// Background write started by write_parquet_async. The K arguments stay
+// pinned until the job is finished on the q thread, from its sd1 callback or
+// from write_parquet_wait.
+struct AsyncWrite {
+  WriteRequest req;
+  K table = nullptr, opts = nullptr, callback = nullptr;
+  int fds[2] = {-1, -1};
+  thread worker;
+  atomic<bool> done{false};
+  bool finished = false;
+  Status status;
+};
+static unordered_map<J, unique_ptr<AsyncWrite>> async_writes;
+static J last_async_id = 0;
+// Joins the worker and unpins the job's K objects; runs on the q thread
+void finish_async(AsyncWrite& job) {
+  if (job.finished) return;
+  job.worker.join();
+  sd0(job.fds[0]); // also closes the read end
+  close(job.fds[1]);
+  r0(job.table);
+  r0(job.opts);
+  job.finished = true;
+}
+K on_async_done(I fd) {
+  for (auto it = async_writes.begin(); it != async_writes.end(); ++it) {
+    AsyncWrite& job = *it->second;
+    if (job.finished || job.fds[0] != fd) continue;
+    finish_async(job);
+    if (job.callback) {
+      K callback = job.callback;
+      string msg = job.status.ok() ? "" : job.status.message();
+      K args = knk(2, kj(it->first), kp((S)msg.c_str()));
+      async_writes.erase(it);
+      K result = dot(callback, args);
+      r0(args);
+      r0(callback);
+      if (result) r0(result);
+    }
+    break;
+  }
+  return (K)0;
+}
+extern "C" K write_parquet_async(K table, K path, K k_par_cols, K opts,
+                                 K callback) {
+  static string k_err;
+  Status status;
+  auto job = make_unique<AsyncWrite>();
+  CHECK_STATUS(parse_write_request(table, path, k_par_cols, opts, job->req));
+  if (job->req.stats) {
+    return krr((S) "stats is only supported by write_parquet");
+  }
+  // r1/r0 and vi must stay on the q thread
+  job->req.ctx.opts.zero_copy = false;
+  CHECK_STATUS(convert_q_columns(table, job->req.ctx));
+  if (pipe(job->fds)) {
+    return krr((S) "pipe");
+  }
+  job->table = r1(table);
+  job->opts = r1(job->req.opts);
+  if (callback->t != 101) job->callback = r1(callback);
+  sd1(job->fds[0], on_async_done);
+  AsyncWrite* p = job.get();
+  p->worker = thread([p] {
+    p->status = write_table(p->table, p->req);
+    p->done = true;
+    char c = 0;
+    while (write(p->fds[1], &c, 1) < 0 && errno == EINTR) {
+    }
+  });
+  J id = ++last_async_id;
+  async_writes[id] = move(job);
+  return kj(id);
+}
+extern "C" K write_parquet_status(K id) {
+  if (id->t != -KJ) {
+    return krr((S) "id not a long");
+  }
+  auto it = async_writes.find(id->j);
+  if (it == async_writes.end()) {
+    return krr((S) "unknown write");
+  }
+  AsyncWrite& job = *it->second;
+  if (!job.done) return ks((S) "running");
+  return ks((S)(job.status.ok() ? "done" : "failed"));
+}
+extern "C" K write_parquet_wait(K id) {
+  if (id->t != -KJ) {
+    return krr((S) "id not a long");
+  }
+  auto it = async_writes.find(id->j);
+  if (it == async_writes.end()) {
+    return krr((S) "unknown write");
+  }
+  unique_ptr<AsyncWrite> job = move(it->second);
+  async_writes.erase(it);
+  finish_async(*job);
+  if (job->callback) r0(job->callback);
+  static string k_err;
+  Status status;
+  CHECK_STATUS(job->status);
+  return (K)0;
+}
+// Batches exported through the C data interface stay alive until the
+// consumer has released every array and the stream. Consumers can release
+// them from any thread, but the KBuffers' r0 must run on the q thread, so
+// releases elsewhere are queued and freed from an sd1 callback.
+struct ExportPin {
+  vector<shared_ptr<RecordBatch>> batches;
+  ~ExportPin();
+};
+static thread::id q_thread;
+static mutex released_mutex;
+static vector<shared_ptr<RecordBatch>> released_batches;
+static int release_fds[2] = {-1, -1};
+K on_export_released(I fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) < 0 && errno == EINTR) {
+  }
+  vector<shared_ptr<RecordBatch>> batches;
+  lock_guard<mutex> lock(released_mutex);
+  batches.swap(released_batches);
+  return (K)0;
+}
+ExportPin::~ExportPin() {
+  if (this_thread::get_id() == q_thread) return;
+  lock_guard<mutex> lock(released_mutex);
+  move(batches.begin(), batches.end(), back_inserter(released_batches));
+  batches.clear();
+  char c = 0;
+  // non-blocking: a full pipe already has the callback pending
+  while (write(release_fds[1], &c, 1) < 0 && errno == EINTR) {
+  }
+}
+class PinnedBuffer : public Buffer {
+public:
+  PinnedBuffer(const Buffer& buffer, shared_ptr<ExportPin> pin)
+      : Buffer(buffer.data(), buffer.size()), pin_(move(pin)) {}
+
+private:
+  shared_ptr<ExportPin> pin_;
+};
+// Copy of an array whose buffers point into the original's but hold the pin
+shared_ptr<ArrayData> pinned_view(const ArrayData& data,
+                                  const shared_ptr<ExportPin>& pin) {
+  auto view = make_shared<ArrayData>(data);
+  for (auto& buffer : view->buffers) {
+    if (buffer) buffer = make_shared<PinnedBuffer>(*buffer, pin);
+  }
+  for (auto& child : view->child_data) child = pinned_view(*child, pin);
+  if (view->dictionary) view->dictionary = pinned_view(*view->dictionary, pin);
+  return view;
+}
+// Converts the table in chunk_size batches, by default wrapping its vectors
+// without copying them, and exports them as an ArrowArrayStream
+Status export_stream(K table, K opts, ArrowArrayStream* stream) {
+  if (table->t != XT) {
+    return Status::Invalid("not a table");
+  }
+  if (opts->t != XD) {
+    return Status::Invalid("opts not a dictionary");
+  }
+  K keys = kK(opts)[0];
+  for (size_t i = 0; i < keys->n; ++i) {
+    if (allowed_options.find(kS(keys)[i]) == allowed_options.end()) {
+      return Status::Invalid("Invalid option: " + string(kS(keys)[i]));
+    }
+  }
+  ConvertOptions conv_opts;
+  conv_opts.zero_copy = true;
+  ARROW_RETURN_NOT_OK(set_convert_options(opts, conv_opts));
+  conv_opts.streaming = true; // batches convert chunk_size rows at a time
+  if (conv_opts.stats || conv_opts.max_memory) {
+    return Status::Invalid("stats and max_memory are not supported by "
+                           "export_arrow");
+  }
+  if (release_fds[0] < 0) {
+    if (pipe(release_fds)) return Status::IOError("pipe: ", strerror(errno));
+    fcntl(release_fds[1], F_SETFL, O_NONBLOCK);
+    sd1(release_fds[0], on_export_released);
+  }
+  q_thread = this_thread::get_id();
+  ConvertContext ctx;
+  ctx.memory_pool = conv_opts.memory_pool;
+  ARROW_RETURN_NOT_OK(prepare_convert(table, conv_opts, ctx));
+  auto pin = make_shared<ExportPin>();
+  int64_t n_rows = table_rows(table);
+  int64_t chunk_size = ctx.opts.chunk_size;
+  for (int64_t offset = 0; offset == 0 || offset < n_rows;
+       offset += chunk_size) {
+    shared_ptr<RecordBatch> batch;
+    ARROW_RETURN_NOT_OK(kdb_to_arrow(batch, table, ctx, offset,
+                                     min(chunk_size, n_rows - offset)));
+    pin->batches.push_back(batch);
+  }
+  shared_ptr<Schema> schema = pin->batches[0]->schema();
+  vector<shared_ptr<RecordBatch>> views;
+  for (auto& batch : pin->batches) {
+    vector<shared_ptr<ArrayData>> columns;
+    for (auto& column : batch->column_data()) {
+      columns.push_back(pinned_view(*column, pin));
+    }
+    views.push_back(RecordBatch::Make(schema, batch->num_rows(), columns));
+  }
+  pin.reset(); // the views hold it now
+  shared_ptr<RecordBatchReader> reader;
+  ARROW_ASSIGN_OR_RAISE(reader, RecordBatchReader::Make(views, schema));
+  return ExportRecordBatchReader(reader, stream);
+}
+// Returns the address of an ArrowArrayStream, for consumers in the same
+// process (pyarrow, DuckDB). Free it with release_arrow once consumed.
+extern "C" K export_arrow(K table, K opts) {
+  static string k_err;
+  Status status;
+  auto stream = make_unique<ArrowArrayStream>();
+  CHECK_STATUS(export_stream(table, opts, stream.get()));
+  return kj((J)stream.release());
+}
+// Releases the stream if the consumer has not taken it over, then frees the
+// struct itself
+extern "C" K release_arrow(K handle) {
+  if (handle->t != -KJ || !handle->j) {
+    return krr((S) "handle not a long");
+  }
+  auto stream = reinterpret_cast<ArrowArrayStream*>(handle->j);
+  if (stream->release) stream->release(stream);
+  delete stream;
+  return (K)0;
+}
+// Open Parquet file that write_batch appends one row group per batch to.
+// The conversion context, thread pool and buffers outlive each batch.
+struct WriterSession {
+  vector<string> names;
+  vector<signed char> types;
+  RecyclingPool memory_pool;
+  shared_ptr<WritePool> capped_pool;
+  shared_ptr<io::OutputStream> outfile;
+  unique_ptr<parquet::arrow::FileWriter> writer;
+  ConvertContext ctx;
+};
+static unordered_map<J, unique_ptr<WriterSession>> writers;
+static J last_writer_id = 0;
+// Column type as far as the Arrow schema is concerned: all enumerations map
+// to the same dictionary type, and anymaps convert like string lists
+signed char schema_type(K col) {
+  if (col->t >= 20 && col->t <= 76) return 20;
+  return col->t == 77 ? 0 : col->t;
+}
+Status open_session(K path, K schema, K opts, WriterSession& session) {
+  if (path->t != -KS) {
+    return Status::Invalid("Path not a symbol");
+  }
+  if (schema->t != XT) {
+    return Status::Invalid("schema not a table");
+  }
+  if (opts->t != XD) {
+    return Status::Invalid("opts not a dictionary");
+  }
+  ConvertOptions conv_opts;
+  ARROW_RETURN_NOT_OK(set_convert_options(opts, conv_opts));
+  if (conv_opts.stats) {
+    return Status::Invalid("stats is only supported by write_parquet");
+  }
+  // Later batches could not be checked against keys fixed at open
+  if (conv_opts.sort_check || !conv_opts.sorting_columns.empty()) {
+    return Status::Invalid("sorting_columns is not supported by writer "
+                           "sessions");
+  }
+  // Batches recycle buffers unless another pool was asked for
+  MemoryPool* pool = conv_opts.memory_pool == default_memory_pool()
+                         ? &session.memory_pool
+                         : conv_opts.memory_pool;
+  if (conv_opts.max_memory) {
+    session.capped_pool =
+        make_shared<WritePool>(pool, conv_opts.max_memory);
+    pool = session.capped_pool.get();
+  }
+  session.ctx.memory_pool = pool;
+  auto arrow_props = parquet::default_arrow_writer_properties();
+  auto parq_props = parquet::default_writer_properties();
+  ARROW_RETURN_NOT_OK(
+      set_writer_properties(opts, arrow_props, parq_props, pool, schema));
+  ARROW_RETURN_NOT_OK(prepare_convert(schema, conv_opts, session.ctx));
+  // The file's schema is fixed here: symbol columns stay dictionaries (or
+  // plain strings, if the schema's rows say so) for every batch
+  session.ctx.fixed_sym_dicts = true;
+  shared_ptr<RecordBatch> empty;
+  ARROW_RETURN_NOT_OK(kdb_to_arrow(empty, schema, session.ctx, 0, 0));
+  K col_names = kK(schema->k)[0];
+  K col_vectors = kK(schema->k)[1];
+  for (J c = 0; c < col_names->n; ++c) {
+    session.names.emplace_back(kS(col_names)[c]);
+    session.types.push_back(schema_type(kK(col_vectors)[c]));
+  }
+  string file = filesystem::absolute(filesystem::path(path->s)).string();
+  ARROW_ASSIGN_OR_RAISE(session.outfile, OutputFileSystem(conv_opts.output)
+                                             .OpenOutputStream(file));
+  ARROW_ASSIGN_OR_RAISE(session.writer,
+                        parquet::arrow::FileWriter::Open(
+                            *empty->schema(), pool, session.outfile,
+                            parq_props, arrow_props));
+  return Status::OK();
+}
+Status write_session_batch(WriterSession& session, K table) {
+  if (table->t != XT) {
+    return Status::Invalid("not a table");
+  }
+  K col_names = kK(table->k)[0];
+  K col_vectors = kK(table->k)[1];
+  if (col_names->n != session.names.size()) {
+    return Status::Invalid("batch does not match writer schema");
+  }
+  for (J c = 0; c < col_names->n; ++c) {
+    if (session.names[c] != kS(col_names)[c] ||
+        session.types[c] != schema_type(kK(col_vectors)[c])) {
+      return Status::Invalid("batch does not match writer schema: " +
+                             session.names[c]);
+    }
+  }
+  int64_t n_rows = table_rows(table);
+  if (!n_rows) return Status::OK();
+  session.ctx.domains.clear(); // keyed by sym lists that may since be freed
+  ARROW_RETURN_NOT_OK(prepare_convert(table, session.ctx.opts, session.ctx));
+  shared_ptr<Table> arrow_table;
+  ARROW_RETURN_NOT_OK(kdb_to_arrow(arrow_table, table, session.ctx));
+  return session.writer->WriteTable(*arrow_table, session.ctx.opts.chunk_size);
+}
+extern "C" K open_writer(K path, K schema, K opts) {
+  static string k_err;
+  Status status;
+  auto session = make_unique<WriterSession>();
+  CHECK_STATUS(open_session(path, schema, opts, *session));
+  J handle = ++last_writer_id;
+  writers[handle] = move(session);
+  return kj(handle);
+}
+extern "C" K write_batch(K handle, K table) {
+  static string k_err;
+  Status status;
+  if (handle->t != -KJ) {
+    return krr((S) "handle not a long");
+  }
+  auto it = writers.find(handle->j);
+  if (it == writers.end()) {
+    return krr((S) "unknown writer");
+  }
+  CHECK_STATUS(write_session_batch(*it->second, table));
+  return (K)0;
+}
+extern "C" K close_writer(K handle) {
+  static string k_err;
+  Status status;
+  if (handle->t != -KJ) {
+    return krr((S) "handle not a long");
+  }
+  auto it = writers.find(handle->j);
+  if (it == writers.end()) {
+    return krr((S) "unknown writer");
+  }
+  unique_ptr<WriterSession> session = move(it->second);
+  writers.erase(it);
+  CHECK_STATUS(session->writer->Close());
+  CHECK_STATUS(session->outfile->Close());
   return (K)0;
 }
+// Splayed table of one HDB partition, written on a background thread
+struct HdbPartition {
+  I date;
+  K table = nullptr;
+  WriteRequest req;
+  int64_t bytes = 0; // estimated peak memory of the write
+  bool done = false;
+  Status status;
+};
+// Formats a kdb date as YYYY<sep>MM<sep>DD
+string format_date(I date, char sep) {
+  int z = date + 10957 + 719468;
+  int era = (z >= 0 ? z : z - 146096) / 146097;
+  int doe = z - era * 146097;
+  int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int mp = (5 * doy + 2) / 153;
+  int d = doy - (153 * mp + 2) / 5 + 1;
+  int m = mp < 10 ? mp + 3 : mp - 9;
+  int y = yoe + era * 400 + (m <= 2);
+  char buf[32];
+  snprintf(buf, sizeof buf, "%04d%c%02d%c%02d", y, sep, m, sep, d);
+  return buf;
+}
+// Loads a file with q's get, which maps splayed columns rather than reading
+// them
+Status q_get(const filesystem::path& file, K& result) {
+  result = k(0, (S) "get", ks((S)(":" + file.string()).c_str()), (K)0);
+  if (!result) return Status::IOError("get failed: " + file.string());
+  if (result->t == -128) {
+    string err = result->s;
+    r0(result);
+    result = nullptr;
+    return Status::IOError(err + ": " + file.string());
+  }
+  return Status::OK();
+}
+Status map_partition(const filesystem::path& dir, K& table) {
+  K names;
+  ARROW_RETURN_NOT_OK(q_get(dir / ".d", names));
+  if (names->t != KS) {
+    r0(names);
+    return Status::Invalid("not a splayed table: " + dir.string());
+  }
+  K cols = ktn(0, 0);
+  for (J c = 0; c < names->n; ++c) {
+    K col;
+    Status st = q_get(dir / kS(names)[c], col);
+    if (!st.ok()) {
+      r0(names);
+      r0(cols);
+      return st;
+    }
+    jk(&cols, col);
+  }
+  table = xT(xD(names, cols));
+  return Status::OK();
+}
+// Rough peak memory of converting and encoding a partition
+int64_t partition_bytes(K table, const ConvertOptions& opts) {
+  int64_t rows = table_rows(table);
+  // streaming holds one slice converting and one encoding
+  if (opts.streaming) rows = min(rows, 2 * opts.chunk_size);
+  return rows * row_bytes(table);
+}
+// Writes the given dates of an HDB table as one Hive dataset, partitioned by
+// date. Partitions are mapped and prepared on the q thread, then converted and
+// written concurrently while their estimated memory fits the budget.
+Status write_hdb(K root, K table_name, K dates, K path, K opts,
+                 vector<I>& written) {
+  if (root->t != -KS || table_name->t != -KS || path->t != -KS) {
+    return Status::Invalid("root, table and path must be symbols");
+  }
+  if (dates->t != KD && dates->t != -KD) {
+    return Status::Invalid("dates must be a date or date list");
+  }
+  if (opts->t != XD) {
+    return Status::Invalid("opts not a dictionary");
+  }
+  string root_dir = root->s[0] == ':' ? root->s + 1 : root->s;
+  string out_dir = path->s[0] == ':' ? path->s + 1 : path->s;
+  // Filesystem errors are returned, not thrown across the C boundary
+  error_code ec;
+  filesystem::path hdb = filesystem::absolute(root_dir, ec);
+  filesystem::path base;
+  if (!ec) base = filesystem::absolute(out_dir, ec);
+  if (ec) return Status::IOError(ec.message());
+  ConvertOptions conv_opts;
+  ARROW_RETURN_NOT_OK(set_convert_options(opts, conv_opts));
+  if (conv_opts.stats) {
+    return Status::Invalid("stats is only supported by write_parquet");
+  }
+  conv_opts.zero_copy = false; // r0 must stay on the q thread
+  // max_memory caps all partitions together
+  shared_ptr<WritePool> capped_pool;
+  MemoryPool* mem_pool = conv_opts.memory_pool;
+  if (conv_opts.max_memory) {
+    capped_pool = make_shared<WritePool>(mem_pool, conv_opts.max_memory);
+    mem_pool = capped_pool.get();
+  }
+  J threads = max(1u, thread::hardware_concurrency()), budget = 0;
+  K keys = kK(opts)[0];
+  K vals = kK(opts)[1];
+  for (J i = 0; i < keys->n; ++i) {
+    string opt(kS(keys)[i]);
+    if (opt == "partition_threads" && (!opt_long(vals, i, threads) ||
+                                       threads <= 0)) {
+      return Status::Invalid("partition_threads must be a positive long");
+    }
+    if (opt == "memory_budget" && (!opt_long(vals, i, budget) || budget < 0)) {
+      return Status::Invalid("memory_budget must be a long >= 0");
+    }
+  }
+  // The sym file is loaded once and shared by every partition
+  K syms;
+  ARROW_RETURN_NOT_OK(q_get(hdb / "sym", syms));
+  EnumDomain domain;
+  Status st = syms->t == KS ? make_domain(syms, domain)
+                            : Status::Invalid("sym file is not a symbol list");
+  shared_ptr<internal::ThreadPool> pool;
+  if (st.ok()) {
+    auto pool_result = internal::ThreadPool::Make(threads);
+    st = pool_result.status();
+    if (st.ok()) pool = *pool_result;
+  }
+  vector<unique_ptr<HdbPartition>> parts;
+  vector<bool> sym_dicts;
+  mutex m;
+  condition_variable cond;
+  int running = 0;
+  int64_t in_flight = 0;
+  // Partitions are unmapped on the q thread as they finish
+  auto release_done = [&] {
+    for (auto& part : parts) {
+      if (part->done && part->table) {
+        r0(part->table);
+        part->table = nullptr;
+      }
+    }
+  };
+  J n_dates = dates->t == KD ? dates->n : 1;
+  for (J i = 0; st.ok() && i < n_dates; ++i) {
+    I date = dates->t == KD ? kI(dates)[i] : dates->i;
+    filesystem::path dir = hdb / format_date(date, '.') / table_name->s;
+    bool found = filesystem::exists(dir / ".d", ec);
+    if (ec) {
+      st = Status::IOError(ec.message(), ": ", dir.string());
+      break;
+    }
+    if (!found) continue; // no data that day
+    filesystem::path out = base / ("date=" + format_date(date, '-'));
+    filesystem::create_directories(out, ec);
+    if (ec) {
+      st = Status::IOError(ec.message(), ": ", out.string());
+      break;
+    }
+    auto part = make_unique<HdbPartition>();
+    part->date = date;
+    st = map_partition(dir, part->table);
+    if (!st.ok()) break;
+    part->req.path = out / "part0.parquet";
+    part->req.opts = opts;
+    part->req.ctx.syms = syms;
+    part->req.ctx.domains[syms] = domain;
+    part->req.ctx.memory_pool = mem_pool;
+    // each partition running at once gets its share of max_memory, at least
+    // a byte, as 0 would lift the limit
+    ConvertOptions part_opts = conv_opts;
+    if (conv_opts.max_memory) {
+      fit_memory(part->table, max<int64_t>(1, conv_opts.max_memory / threads),
+                 part_opts);
+    }
+    // the first partition picks dictionary or plain symbols for all files
+    if (!sym_dicts.empty()) {
+      part->req.ctx.sym_dicts = sym_dicts;
+      part->req.ctx.fixed_sym_dicts = true;
+    }
+    st = prepare_convert(part->table, part_opts, part->req.ctx);
+    if (st.ok() && sym_dicts.empty()) sym_dicts = part->req.ctx.sym_dicts;
+    if (st.ok()) st = convert_q_columns(part->table, part->req.ctx);
+    part->bytes = partition_bytes(part->table, part_opts);
+    HdbPartition* p = part.get();
+    parts.push_back(move(part));
+    if (!st.ok()) break;
+    unique_lock<mutex> lock(m);
+    cond.wait(lock, [&] {
+      return running == 0 || (running < threads &&
+                              (!budget || in_flight + p->bytes <= budget));
+    });
+    ++running;
+    in_flight += p->bytes;
+    lock.unlock();
+    st = pool->Spawn([&, p] {
+      Status write_st = write_table(p->table, p->req);
+      lock_guard<mutex> lock(m);
+      p->status = write_st;
+      p->done = true;
+      --running;
+      in_flight -= p->bytes;
+      cond.notify_all();
+    });
+    if (!st.ok()) {
+      lock.lock();
+      --running;
+      in_flight -= p->bytes;
+      p->done = true;
+      break;
+    }
+    lock.lock();
+    release_done();
+  }
+  {
+    unique_lock<mutex> lock(m);
+    cond.wait(lock, [&] { return running == 0; });
+  }
+  for (auto& part : parts) {
+    if (!part->done) part->done = true; // prepared but never started
+    if (st.ok() && !part->status.ok()) {
+      st = Status::IOError(format_date(part->date, '.') + ": " +
+                           part->status.message());
+    }
+    if (part->status.ok()) written.push_back(part->date);
+  }
+  release_done();
+  r0(syms);
+  return st;
+}
+extern "C" K write_hdb_parquet(K root, K table_name, K dates, K path,
+                               K opts) {
+  static string k_err;
+  Status status;
+  vector<I> written;
+  CHECK_STATUS(write_hdb(root, table_name, dates, path, opts, written));
+  K result = ktn(KD, written.size());
+  copy(written.begin(), written.end(), kI(result));
+  return result;
+}